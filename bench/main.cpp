@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lb/util.h"
+#include "vmlua/driver.h"
+
+/**
+ * vmlua_bench: runs every workload through the stack engine pipeline a
+ * number of times, timing each phase separately, and reports the median,
+ * min and max of each phase as csv (and optionally json). given a baseline
+ * csv written by an earlier run, a phase whose median got slower by more
+ * than the threshold fails the run.
+ *
+ * the front end traces to std::cout and std::cerr, which are silenced while
+ * timing, and the scripts print into /dev/null.
+ */
+namespace {
+using namespace lb::vmlua;
+using clock_type = std::chrono::steady_clock;
+
+const char* const phases[] = {"lex", "parse", "fold", "emit", "link", "peephole", "superinst", "run", "total"};
+
+struct workload {
+    std::string name;
+    std::string path;
+};
+
+struct stats {
+    double median;
+    double min;
+    double max;
+};
+
+class bench_options
+{
+public:
+    size_t runs{5};
+    size_t warmup{1};
+    double threshold{0.1};
+    // phases faster than this in the baseline are too noisy to compare
+    double min_ms{5.0};
+    bool jit{true};
+    std::string csv;
+    std::string json;
+    std::string baseline;
+    std::string filter;
+    std::vector<std::string> files;
+
+    bool parse(int argc, char const* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+            if (arg == "--runs") {
+                runs = std::max<size_t>(std::stoul(value()), 1);
+            } else if (arg == "--warmup") {
+                warmup = std::stoul(value());
+            } else if (arg == "--threshold") {
+                threshold = std::stod(value()) / 100;
+            } else if (arg == "--min-ms") {
+                min_ms = std::stod(value());
+            } else if (arg == "--no-jit") {
+                jit = false;
+            } else if (arg == "--csv") {
+                csv = value();
+            } else if (arg == "--json") {
+                json = value();
+            } else if (arg == "--baseline") {
+                baseline = value();
+            } else if (arg == "--filter") {
+                filter = value();
+            } else if (!arg.empty() && arg[0] == '-') {
+                return false;
+            } else {
+                files.push_back(arg);
+            }
+        }
+        return true;
+    }
+
+    static std::string usage(std::string const& program) {
+        return lb::string_util::concat(
+            "Usage: ", program,
+            " [--runs n] [--warmup n] [--no-jit] [--filter name] [--csv path] [--json path]\n"
+            "       [--baseline path] [--threshold percent] [--min-ms ms] [workload.lua ...]");
+    }
+};
+
+// many small functions, so that the front end dominates
+std::string generate_large_source(size_t functions) {
+    std::ostringstream src;
+    for (size_t i = 0; i < functions; i++) {
+        src << "function f" << i << "(a, b)\n"
+            << "   local x = a + b;\n"
+            << "   if x > " << i * 3 << " then\n"
+            << "      return x + " << i << ";\n"
+            << "   else\n"
+            << "      local y = x + b;\n"
+            << "      return y + a;\n"
+            << "   end\n"
+            << "end\n\n";
+    }
+    for (size_t i = 0; i < functions; i += functions / 16 + 1) {
+        src << "print(f" << i << "(" << i << ", 2));\n";
+    }
+    return src.str();
+}
+
+std::vector<workload> find_workloads(bench_options const& options) {
+    std::vector<workload> workloads;
+    if (!options.files.empty()) {
+        for (auto& file : options.files) {
+            workloads.push_back(workload{std::filesystem::path(file).stem().string(), file});
+        }
+        return workloads;
+    }
+    for (auto& entry : std::filesystem::directory_iterator(VMLUA_BENCH_DIR)) {
+        if (entry.path().extension() == ".lua") {
+            workloads.push_back(workload{entry.path().stem().string(), entry.path().string()});
+        }
+    }
+    auto large = std::filesystem::temp_directory_path() / "vmlua_bench_large_source.lua";
+    std::ofstream(large) << generate_large_source(2000);
+    workloads.push_back(workload{"large_source", large.string()});
+    std::sort(workloads.begin(), workloads.end(),
+              [](workload const& l, workload const& r) { return l.name < r.name; });
+    return workloads;
+}
+
+// one run of the pipeline the driver runs by default, milliseconds per phase
+std::map<std::string, double> run_once(workload const& w, bool use_jit, output& out) {
+    std::map<std::string, double> times;
+    auto start = clock_type::now();
+    auto last = start;
+    auto lap = [&](const char* phase) {
+        auto now = clock_type::now();
+        times[phase] = std::chrono::duration<double, std::milli>(now - last).count();
+        last = now;
+    };
+
+    source src(w.path);
+    lexer lexer(src);
+    auto tokens = lexer.tokenize();
+    lap("lex");
+    parser parser(tokens);
+    auto ast = parser.parse();
+    lap("parse");
+    const_folder folder;
+    folder.optimize(ast);
+    lap("fold");
+    emitter emitter;
+    auto prog = emitter.compile(ast);
+    lap("emit");
+    linker linker;
+    linker.link(prog);
+    lap("link");
+    peephole peephole;
+    peephole.optimize(prog);
+    lap("peephole");
+    superinst superinst;
+    superinst.fuse(prog, superinst.select(superinst.measure(prog)));
+    lap("superinst");
+    vm vm;
+    vm.set_output(&out);
+    std::unique_ptr<jit> native;
+    if (use_jit && jit::supported()) {
+        native = std::make_unique<jit>(prog, vm);
+        vm.set_call_hook(native.get());
+    }
+    vm.eval(prog);
+    lap("run");
+    times["total"] = std::chrono::duration<double, std::milli>(last - start).count();
+    return times;
+}
+
+stats summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    auto n = samples.size();
+    auto median = n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    return stats{median, samples.front(), samples.back()};
+}
+
+using results = std::map<std::string, std::map<std::string, stats>>;
+
+void write_csv(std::ostream& out, results const& res, size_t runs) {
+    out << "workload,phase,runs,median_ms,min_ms,max_ms\n";
+    for (auto& w : res) {
+        for (auto phase : phases) {
+            auto& s = w.second.at(phase);
+            out << w.first << "," << phase << "," << runs << "," << s.median << "," << s.min << "," << s.max << "\n";
+        }
+    }
+}
+
+void write_json(std::ostream& out, results const& res, size_t runs) {
+    out << "{\n  \"runs\": " << runs << ",\n  \"workloads\": {";
+    auto first_workload = true;
+    for (auto& w : res) {
+        out << (first_workload ? "\n" : ",\n") << "    \"" << w.first << "\": {";
+        auto first_phase = true;
+        for (auto phase : phases) {
+            auto& s = w.second.at(phase);
+            out << (first_phase ? "\n" : ",\n") << "      \"" << phase << "\": {\"median_ms\": " << s.median
+                << ", \"min_ms\": " << s.min << ", \"max_ms\": " << s.max << "}";
+            first_phase = false;
+        }
+        out << "\n    }";
+        first_workload = false;
+    }
+    out << "\n  }\n}\n";
+}
+
+// (workload, phase) -> median of a csv written by write_csv
+std::map<std::pair<std::string, std::string>, double> read_baseline(std::string const& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot read baseline " + path);
+    }
+    std::map<std::pair<std::string, std::string>, double> medians;
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        auto fields = lb::string_util::split(line, ',', false);
+        if (fields.size() >= 4) {
+            medians[{fields[0], fields[1]}] = std::stod(fields[3]);
+        }
+    }
+    return medians;
+}
+
+// prints the change of every phase, returns the number of regressions
+size_t compare(results const& res, bench_options const& options) {
+    auto baseline = read_baseline(options.baseline);
+    size_t regressions = 0;
+    std::cout << "[bench] against " << options.baseline << ", threshold " << options.threshold * 100 << "%\n";
+    for (auto& w : res) {
+        for (auto phase : phases) {
+            auto it = baseline.find({w.first, phase});
+            if (it == baseline.end() || it->second < options.min_ms) {
+                continue;
+            }
+            auto current = w.second.at(phase).median;
+            auto change = (current - it->second) / it->second;
+            auto regressed = change > options.threshold;
+            regressions += regressed;
+            std::cout << std::setw(16) << w.first << std::setw(10) << phase << std::setw(12) << std::fixed
+                      << std::setprecision(3) << it->second << " -> " << std::setw(10) << current << " ms "
+                      << std::showpos << std::setprecision(1) << change * 100 << "%" << std::noshowpos
+                      << (regressed ? "  REGRESSION" : "") << '\n';
+        }
+    }
+    return regressions;
+}
+}  // namespace
+
+int main(int argc, char const* argv[]) {
+    bench_options options;
+    if (!options.parse(argc, argv)) {
+        std::cout << bench_options::usage(argv[0]) << std::endl;
+        return 2;
+    }
+    auto workloads = find_workloads(options);
+
+    std::FILE* devnull = std::fopen("/dev/null", "w");
+    results res;
+    for (auto& w : workloads) {
+        if (!options.filter.empty() && w.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        std::map<std::string, std::vector<double>> samples;
+        for (size_t i = 0; i < options.warmup + options.runs; i++) {
+            std::map<std::string, double> times;
+            {
+                output out(devnull != nullptr ? devnull : stdout, output::default_capacity, output::flush_full);
+                // failed streams skip formatting, so tracing costs next to nothing
+                std::cout.setstate(std::ios::badbit);
+                std::cerr.setstate(std::ios::badbit);
+                scope_guard restore([]() {
+                    std::cout.clear();
+                    std::cerr.clear();
+                });
+                times = run_once(w, options.jit, out);
+            }
+            if (i < options.warmup) {
+                continue;
+            }
+            for (auto& t : times) {
+                samples[t.first].push_back(t.second);
+            }
+        }
+        for (auto& s : samples) {
+            res[w.name][s.first] = summarize(s.second);
+        }
+        std::cerr << "[bench] " << w.name << ": " << res[w.name]["total"].median << " ms" << std::endl;
+    }
+
+    write_csv(std::cout, res, options.runs);
+    if (!options.csv.empty()) {
+        std::ofstream csv(options.csv);
+        write_csv(csv, res, options.runs);
+    }
+    if (!options.json.empty()) {
+        std::ofstream json(options.json);
+        write_json(json, res, options.runs);
+    }
+    try {
+        if (!options.baseline.empty() && compare(res, options) > 0) {
+            return 1;
+        }
+    } catch (std::exception const& e) {
+        std::cerr << "[bench] " << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}
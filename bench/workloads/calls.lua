@@ -0,0 +1,34 @@
+function max(a, b)
+   if a > b then
+      return a;
+   end
+   return b;
+end
+
+function min(a, b)
+   if a < b then
+      return a;
+   end
+   return b;
+end
+
+function clamp(x, lo, hi)
+   local y = max(x, lo);
+   return min(y, hi);
+end
+
+function step(i, acc)
+   local c = clamp(i, 100, 900);
+   local m = max(acc, c);
+   return m + 1;
+end
+
+function loop(i, acc)
+   if i == 0 then
+      return acc;
+   end
+   local next = step(i, acc);
+   return loop(i+-1, next);
+end
+
+print(loop(3000000, 0));
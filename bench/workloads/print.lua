@@ -0,0 +1,9 @@
+function lines(n)
+   if n == 0 then
+      return 0;
+   end
+   print(n, n + n, n + 7);
+   return lines(n+-1);
+end
+
+lines(200000);
@@ -0,0 +1,17 @@
+function depth(n)
+   if n == 0 then
+      return 0;
+   end
+   local r = depth(n+-1);
+   return r + 1;
+end
+
+function again(k, acc)
+   if k == 0 then
+      return acc;
+   end
+   local d = depth(60000);
+   return again(k+-1, acc + d);
+end
+
+print(again(200, 0));
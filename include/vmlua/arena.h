@@ -0,0 +1,90 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lb::vmlua {
+
+/**
+ * bump allocator for objects that all die together, such as the nodes of one
+ * syntax tree. memory is taken from blocks in order and only given back when
+ * the arena goes away, which runs the destructors of the objects that have
+ * one, latest first. pointers stay valid when the arena is moved.
+ */
+class arena {
+public:
+    static constexpr size_t block_size = 64 * 1024;
+
+private:
+    struct cleanup {
+        void* object;
+        void (*destroy)(void*);
+    };
+    std::vector<std::unique_ptr<std::byte[]>> _blocks;
+    std::byte* _next{nullptr};
+    size_t _left{0};
+    std::vector<cleanup> _cleanups;
+    size_t _allocated{0};
+
+public:
+    arena() = default;
+    ~arena() { release(); }
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    arena(arena&& other) noexcept { *this = std::move(other); }
+    arena& operator=(arena&& other) noexcept {
+        std::swap(_blocks, other._blocks);
+        std::swap(_next, other._next);
+        std::swap(_left, other._left);
+        std::swap(_cleanups, other._cleanups);
+        std::swap(_allocated, other._allocated);
+        return *this;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        auto* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            _cleanups.push_back(cleanup{object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        }
+        return object;
+    }
+
+    void* allocate(size_t size, size_t align) {
+        auto padding = (align - reinterpret_cast<uintptr_t>(_next) % align) % align;
+        if (_next == nullptr || padding + size > _left) {
+            // objects larger than a block get a block of their own
+            auto capacity = std::max(block_size, size + align);
+            _blocks.push_back(std::make_unique<std::byte[]>(capacity));
+            _next = _blocks.back().get();
+            _left = capacity;
+            padding = (align - reinterpret_cast<uintptr_t>(_next) % align) % align;
+        }
+        auto* p = _next + padding;
+        _next = p + size;
+        _left -= padding + size;
+        _allocated += size;
+        return p;
+    }
+
+    // bytes handed out, not counting alignment padding
+    size_t allocated() const { return _allocated; }
+
+private:
+    void release() {
+        for (auto it = _cleanups.rbegin(); it != _cleanups.rend(); ++it) {
+            it->destroy(it->object);
+        }
+        _cleanups.clear();
+        _blocks.clear();
+        _next = nullptr;
+        _left = 0;
+        _allocated = 0;
+    }
+};
+}  // namespace lb::vmlua
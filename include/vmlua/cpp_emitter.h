@@ -0,0 +1,285 @@
+#pragma once
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "natives.h"
+#include "types.h"
+namespace lb::vmlua {
+
+/**
+ * ahead of time backend: lowers the ast to a c++ translation unit with one
+ * function per func_decl and the top level code in vmlua_script().
+ *
+ * the generated code behaves like the stack engine: slots are numbered like
+ * emitter does (a name resolves to its first declaration, unknown names to
+ * slot 0), arithmetic wraps, every operand is evaluated into a temporary in
+ * left to right order, a call binds the last nargs arguments and print
+ * writes its arguments last first.
+ */
+class cpp_emitter {
+private:
+    struct scope {
+        std::map<std::string, size_t> names;
+        size_t slots{0};
+        size_t temps{0};
+        bool top_level{false};
+    };
+    // the first declaration of a name wins, as for the linker
+    std::map<std::string, func_decl*> _functions;
+    native_registry const* _natives;
+
+public:
+    explicit cpp_emitter(native_registry const* natives = nullptr) : _natives(natives) {}
+
+    std::string compile(const ast& ast) {
+        _functions.clear();
+        declare_functions(ast.stmts());
+        std::ostringstream out;
+        out << runtime;
+        for (auto& fn : _functions) {
+            out << "static int32_t " << function_name(fn.first) << "(" << parameters(fn.second) << ");\n";
+        }
+        for (auto& fn : _functions) {
+            out << "\nstatic int32_t " << function_name(fn.first) << "(" << parameters(fn.second) << ") {\n";
+            scope sc;
+            for (size_t i = 0; i < fn.second->params.size(); i++) {
+                sc.names.insert({to_string(fn.second->params[i]), sc.slots++});
+            }
+            std::ostringstream body;
+            compile_block(body, sc, fn.second->body, 1);
+            out << slot_declarations(sc, fn.second->params.size()) << body.str() << "    return 0;\n}\n";
+        }
+        scope sc;
+        sc.top_level = true;
+        std::ostringstream body;
+        compile_block(body, sc, ast.stmts(), 1);
+        out << "\nstatic void vmlua_script() {\n" << slot_declarations(sc, 0) << body.str() << "}\n";
+        out << entry_points;
+        return out.str();
+    }
+
+    // compiles source with the system compiler into an executable, or a
+    // shared object exporting vmlua_main. returns the compiler's exit status,
+    // -1 if it could not be run. the paths go to it as they are, no shell
+    // in between
+    static int build(std::string const& source, std::string const& output, bool shared,
+                     std::string const& compiler = "c++") {
+        std::vector<std::string> args{compiler, "-std=c++17", "-O2"};
+        if (shared) {
+            args.insert(args.end(), {"-shared", "-fPIC", "-DVMLUA_AOT_SHARED"});
+        }
+        args.insert(args.end(), {"-o", output, source});
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(nullptr);
+        auto pid = fork();
+        if (pid == 0) {
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+            return -1;
+        }
+        return WEXITSTATUS(status);
+    }
+
+private:
+    static constexpr const char* runtime = R"(// generated by vmlua, do not edit
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+
+static int32_t vmlua_add(int32_t l, int32_t r) {
+    return static_cast<int32_t>(static_cast<uint32_t>(l) + static_cast<uint32_t>(r));
+}
+static int32_t vmlua_sub(int32_t l, int32_t r) {
+    return static_cast<int32_t>(static_cast<uint32_t>(l) - static_cast<uint32_t>(r));
+}
+// the vm pops the arguments of print, so the last one is written first
+static int32_t vmlua_print(std::initializer_list<int32_t> args) {
+    for (auto it = args.end(); it != args.begin();) {
+        std::cout << *--it << " ";
+    }
+    std::cout << '\n';
+    return 0;
+}
+
+)";
+    static constexpr const char* entry_points = R"(
+#ifdef VMLUA_AOT_SHARED
+extern "C" int vmlua_main() {
+    vmlua_script();
+    std::cout.flush();
+    return 0;
+}
+#else
+int main() {
+    vmlua_script();
+    return 0;
+}
+#endif
+)";
+
+    void declare_functions(stmt_list const& stmts) {
+        for (auto&& stmt : stmts) {
+            if (auto* p = node_cast<func_decl>(stmt)) {
+                if (_natives != nullptr) {
+                    _natives->check_declaration(to_string(p->name));
+                }
+                _functions.insert({to_string(p->name), p});
+                declare_functions(p->body);
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                declare_functions(p->then_body);
+                declare_functions(p->else_body);
+            }
+        }
+    }
+
+    static std::string function_name(std::string const& name) { return "fn_" + name; }
+    static std::string slot_name(size_t slot) { return lb::string_util::concat("s", slot); }
+
+    static std::string parameters(func_decl* fd) {
+        std::string params;
+        for (size_t i = 0; i < fd->params.size(); i++) {
+            params += lb::string_util::concat(i == 0 ? "" : ", ", "int32_t ", slot_name(i));
+        }
+        return params;
+    }
+
+    // slots other than parameters start zeroed, like a frame. slot 0 always
+    // exists as unknown names read it
+    static std::string slot_declarations(scope const& sc, size_t nargs) {
+        std::string decls;
+        for (auto i = nargs; i < std::max<size_t>(sc.slots, 1); i++) {
+            decls += lb::string_util::concat("    int32_t ", slot_name(i), " = 0;\n");
+        }
+        return decls;
+    }
+
+    static std::string number(int32_t v) { return v == INT32_MIN ? "INT32_MIN" : std::to_string(v); }
+
+    void compile_block(std::ostream& out, scope& sc, stmt_list const& stmts, int depth) {
+        for (auto&& stmt : stmts) {
+            compile_statement(out, sc, stmt, depth);
+        }
+    }
+
+    void compile_statement(std::ostream& out, scope& sc, stmt_t* stmt, int depth) {
+        std::string indent(depth * 4, ' ');
+        visit(stmt, overloaded{
+                        [&](if_stmt* p) {
+                            auto cond = compile_expr(out, sc, p->condition, depth);
+                            out << indent << "if (" << cond << " != 0) {\n";
+                            compile_block(out, sc, p->then_body, depth + 1);
+                            if (!p->else_body.empty()) {
+                                out << indent << "} else {\n";
+                                compile_block(out, sc, p->else_body, depth + 1);
+                            }
+                            out << indent << "}\n";
+                        },
+                        [&](local_stmt* p) {
+                            // the name is bound before its initializer, which reads the
+                            // new slot, and a redeclared name keeps reading its first
+                            // slot, as in emitter
+                            auto slot = sc.slots++;
+                            sc.names.insert({to_string(p->name), slot});
+                            auto value = compile_expr(out, sc, p->expr, depth);
+                            out << indent << slot_name(slot) << " = " << value << ";\n";
+                        },
+                        [&](ret_stmt* p) {
+                            auto value = compile_expr(out, sc, p->expr, depth);
+                            out << indent << (sc.top_level ? "return;" : "return " + value + ";") << "\n";
+                        },
+                        [&](expr_stmt* p) {
+                            auto value = compile_expr(out, sc, p->expr, depth);
+                            out << indent << "(void)" << value << ";\n";
+                        },
+                        // compiled on their own, see compile
+                        [](func_decl*) {},
+                    });
+    }
+
+    std::string temp(std::ostream& out, scope& sc, std::string const& value, int depth) {
+        auto name = lb::string_util::concat("t", sc.temps++);
+        out << std::string(depth * 4, ' ') << "int32_t " << name << " = " << value << ";\n";
+        return name;
+    }
+
+    // returns an operand holding the value of e, emitting the statements
+    // computing it first
+    std::string compile_expr(std::ostream& out, scope& sc, expr_t* e, int depth) {
+        return visit(e, overloaded{
+                            [&](literal_number* p) { return number(std::stoi(to_string(p->token))); },
+                            [&](literal_id* p) {
+                                auto it = sc.names.find(to_string(p->token));
+                                return slot_name(it != sc.names.end() ? it->second : 0);
+                            },
+                            [&](binary_op* p) {
+                                auto left = compile_expr(out, sc, p->left, depth);
+                                auto right = compile_expr(out, sc, p->right, depth);
+                                return temp(out, sc, binary(to_string(p->op), left, right), depth);
+                            },
+                            [&](func_call* p) { return compile_call(out, sc, p, depth); },
+                        });
+    }
+
+    std::string compile_call(std::ostream& out, scope& sc, func_call* fc, int depth) {
+        std::vector<std::string> args;
+        for (auto&& arg : fc->arguments) {
+            args.push_back(compile_expr(out, sc, arg, depth));
+        }
+        auto name = to_string(fc->name);
+        if (name == "print") {
+            return temp(out, sc, "vmlua_print({" + join(args.begin(), args.end()) + "})", depth);
+        }
+        // natives live in the host process, the built program has none
+        if (_natives != nullptr && _natives->find(name) >= 0) {
+            throw std::runtime_error("native function cannot be compiled ahead of time: " + name);
+        }
+        auto it = _functions.find(name);
+        if (it == _functions.end()) {
+            throw std::runtime_error("undefined symbol: " + name);
+        }
+        // the callee binds the last nargs arguments, the linker rejects fewer
+        auto nargs = it->second->params.size();
+        if (args.size() < nargs) {
+            throw std::runtime_error(lb::string_util::concat("function ", name, " takes ", nargs,
+                                                             " arguments, called with ", args.size()));
+        }
+        auto call = function_name(name) + "(" + join(args.end() - nargs, args.end()) + ")";
+        return temp(out, sc, call, depth);
+    }
+
+    static std::string join(std::vector<std::string>::const_iterator first, std::vector<std::string>::const_iterator last) {
+        std::string joined;
+        for (auto it = first; it != last; ++it) {
+            joined += (it == first ? "" : ", ") + *it;
+        }
+        return joined;
+    }
+
+    static std::string binary(std::string const& oplit, std::string const& l, std::string const& r) {
+        if (oplit == "+") {
+            return "vmlua_add(" + l + ", " + r + ")";
+        } else if (oplit == "-") {
+            return "vmlua_sub(" + l + ", " + r + ")";
+        } else if (oplit == "&&" || oplit == "and") {
+            return l + " & " + r;
+        } else if (oplit == "||" || oplit == "or") {
+            return l + " | " + r;
+        } else if (oplit == "<" || oplit == ">" || oplit == "<=" || oplit == ">=" || oplit == "==" || oplit == "!=") {
+            return "int32_t(" + l + " " + oplit + " " + r + ")";
+        }
+        throw std::runtime_error("unknown operator");
+    }
+};
+}  // namespace lb::vmlua
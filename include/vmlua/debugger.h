@@ -0,0 +1,225 @@
+#pragma once
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "vm.h"
+namespace lb::vmlua {
+
+/**
+ * interactive debugger for the stack vm. it starts out single stepping;
+ * continue runs until a breakpoint or watchpoint is hit:
+ *
+ *  - break <label|pc> [if <slot> <op> <n>] stops before the instruction,
+ *    optionally only while FP + slot compares to n (op: < > <= >= == !=)
+ *  - watch <slot> stops after FP + slot of the current frame changes
+ *  - delete <id> removes a breakpoint or watchpoint, info lists them
+ *  - step (or an empty line), continue, stack, asm, mem <addr>,
+ *    mem <fp|sp> <offset>, debug off and quit
+ */
+class debugger : public debug_hook {
+private:
+    struct breakpoint {
+        size_t id;
+        int32_t pc;
+        bool conditional;
+        int32_t slot;
+        logical_op op;
+        int32_t value;
+    };
+    struct watchpoint {
+        size_t id;
+        int32_t addr;
+        int32_t last;
+    };
+    bool _stepping{true};
+    size_t _next_id{1};
+    std::vector<breakpoint> _breaks;
+    std::vector<watchpoint> _watches;
+    // indexed by pc, whether any breakpoint is set there
+    std::vector<bool> _break_at;
+
+public:
+    bool before(vm& vm, program& prog) override {
+        std::ostringstream hits;
+        if (!hit(vm, hits) && !_stepping) {
+            return true;
+        }
+        _stepping = true;
+        // what the script printed so far comes first
+        vm.output_sink().flush();
+        std::cout << hits.str();
+        auto pc = vm.program_counter();
+        std::cout << "pc = " << pc << ", fp = " << vm.frame_pointer() << ", sp = " << vm.stack_pointer() << '\n';
+        vm.show_asm(prog, pc - 2, pc + 3);
+        return prompt(vm, prog);
+    }
+
+private:
+    // checks every watchpoint, so that each one reports a change once
+    bool hit(vm& vm, std::ostream& hits) {
+        auto stop = false;
+        for (auto& w : _watches) {
+            auto value = vm.stack_at(w.addr);
+            if (value != w.last) {
+                hits << "watch " << w.id << ": mem[" << w.addr << "] " << w.last << " -> " << value << '\n';
+                w.last = value;
+                stop = true;
+            }
+        }
+        auto pc = vm.program_counter();
+        if (pc >= _break_at.size() || !_break_at[pc]) {
+            return stop;
+        }
+        for (auto& b : _breaks) {
+            if (b.pc == pc && (!b.conditional || holds(vm, b))) {
+                hits << "break " << b.id << '\n';
+                stop = true;
+            }
+        }
+        return stop;
+    }
+
+    // a condition on a slot outside the live stack is false, like mem
+    // refuses to read one
+    static bool holds(vm& vm, breakpoint const& b) {
+        auto addr = static_cast<int64_t>(vm.frame_pointer()) + b.slot;
+        if (addr < 0 || addr >= vm.stack_pointer()) {
+            return false;
+        }
+        return logic_cond(b.op, vm.stack_at(static_cast<int32_t>(addr)), b.value);
+    }
+
+    bool prompt(vm& vm, program& prog) {
+        std::cout << "> " << std::flush;
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            auto args = lb::string_util::split(line, ' ');
+            auto command = args.empty() ? "step" : args[0];
+            if (command == "step" || command == "s") {
+                return true;
+            } else if (command == "continue" || command == "c") {
+                _stepping = false;
+                return true;
+            } else if (command == "quit") {
+                return false;
+            } else if (line == "debug off") {
+                vm.set_debugger(nullptr);
+                return true;
+            } else if (command == "break" || command == "b") {
+                add_break(prog, args);
+            } else if (command == "watch" && args.size() == 2 && lb::string_util::is_number(args[1])) {
+                auto addr = vm.frame_pointer() + std::stoi(args[1]);
+                if (addr >= 0 && addr < vm.stack_pointer()) {
+                    _watches.push_back(watchpoint{_next_id, addr, vm.stack_at(addr)});
+                    std::cout << "watch " << _next_id++ << ": mem[" << addr << "]\n";
+                } else {
+                    std::cout << "mem[" << addr << "] = out of range\n";
+                }
+            } else if (command == "delete" && args.size() == 2 && lb::string_util::is_number(args[1])) {
+                remove(std::stoul(args[1]));
+            } else if (command == "info") {
+                info();
+            } else if (command == "stack") {
+                vm.show_stack();
+            } else if (command == "asm") {
+                vm.show_asm(prog);
+            } else if (command == "mem") {
+                mem(vm, args);
+            } else {
+                std::cout << "unknown command: " << line << '\n';
+            }
+            std::cout << "> " << std::flush;
+        }
+        return false;
+    }
+
+    // break <label|pc> [if <slot> <op> <n>]
+    void add_break(program& prog, std::vector<std::string> const& args) {
+        if (args.size() != 2 && args.size() != 6) {
+            std::cout << "usage: break <label|pc> [if <slot> <op> <n>]\n";
+            return;
+        }
+        breakpoint b{_next_id, 0, args.size() == 6, 0, EQ, 0};
+        auto sym = prog.syms.find(args[1]);
+        if (sym != prog.syms.end()) {
+            b.pc = sym->second.loc;
+        } else if (lb::string_util::is_number(args[1])) {
+            b.pc = std::stoi(args[1]);
+        } else {
+            std::cout << "unknown label: " << args[1] << '\n';
+            return;
+        }
+        if (b.pc < 0 || b.pc >= prog.insts.size()) {
+            std::cout << "pc out of range: " << b.pc << '\n';
+            return;
+        }
+        if (b.conditional) {
+            if (args[2] != "if" || !lb::string_util::is_number(args[3]) || !to_logical_op(args[4], b.op) ||
+                !lb::string_util::is_number(args[5])) {
+                std::cout << "invalid condition, expected: if <slot> <op> <n>\n";
+                return;
+            }
+            b.slot = std::stoi(args[3]);
+            b.value = std::stoi(args[5]);
+        }
+        _breaks.push_back(b);
+        _break_at.resize(prog.insts.size(), false);
+        _break_at[b.pc] = true;
+        std::cout << "break " << _next_id++ << " at pc " << b.pc << '\n';
+    }
+
+    void remove(size_t id) {
+        auto is_id = [id](auto const& p) { return p.id == id; };
+        _breaks.erase(std::remove_if(_breaks.begin(), _breaks.end(), is_id), _breaks.end());
+        _watches.erase(std::remove_if(_watches.begin(), _watches.end(), is_id), _watches.end());
+        std::fill(_break_at.begin(), _break_at.end(), false);
+        for (auto& b : _breaks) {
+            _break_at[b.pc] = true;
+        }
+    }
+
+    void info() const {
+        for (auto& b : _breaks) {
+            std::cout << "break " << b.id << " at pc " << b.pc;
+            if (b.conditional) {
+                std::cout << " if FP + " << b.slot << " " << to_string(b.op) << " " << b.value;
+            }
+            std::cout << '\n';
+        }
+        for (auto& w : _watches) {
+            std::cout << "watch " << w.id << ": mem[" << w.addr << "] = " << w.last << '\n';
+        }
+    }
+
+    // mem <addr> or mem <fp|sp> <offset>
+    static void mem(vm& vm, std::vector<std::string> const& args) {
+        auto addr = 0;
+        if (args.size() == 2 && lb::string_util::is_number(args[1])) {
+            addr = std::stoi(args[1]);
+        } else if (args.size() == 3 && (args[1] == "fp" || args[1] == "sp") && lb::string_util::is_number(args[2])) {
+            addr = (args[1] == "fp" ? vm.frame_pointer() : vm.stack_pointer()) + std::stoi(args[2]);
+        } else {
+            std::cout << "usage: mem <addr> or mem <fp|sp> <offset>\n";
+            return;
+        }
+        if (addr >= 0 && addr < vm.stack_pointer()) {
+            std::cout << "mem[" << addr << "] = " << vm.stack_at(addr) << '\n';
+        } else {
+            std::cout << "mem[" << addr << "] = out of range\n";
+        }
+    }
+
+    static bool to_logical_op(std::string const& oplit, logical_op& op) {
+        static const std::pair<const char*, logical_op> ops[] = {{"<", LT},  {">", GT},  {"<=", LE},
+                                                                 {">=", GE}, {"==", EQ}, {"!=", NE}};
+        for (auto& entry : ops) {
+            if (oplit == entry.first) {
+                op = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+}  // namespace lb::vmlua
@@ -4,21 +4,37 @@
 #include <fstream>
 #include <iostream>
 
+#include "cpp_emitter.h"
+#include "debugger.h"
 #include "emitter.h"
+#ifdef VMLUA_HISTOGRAM
+#include "histogram.h"
+#endif
+#include "jit.h"
 #include "lexer.h"
+#include "linker.h"
+#include "optimizer.h"
+#include "output.h"
 #include "parser.h"
+#include "peephole.h"
+#include "profiler.h"
+#include "reg_emitter.h"
+#include "source.h"
+#include "superinst.h"
+#include "trace.h"
 #include "vm.h"
 namespace lb::vmlua {
 class driver {
 private:
-    std::ifstream _file;
+    // tokens and the ast refer to the text, which lives as long as the driver
+    source _source;
+    native_registry _natives;
 
 public:
-    driver(std::string const& path) { _file.open(path); }
-    ~driver() {
-        // no need to close for RAII, but symmetrical aesthetics
-        _file.close();
-    }
+    driver(std::string const& path) : _source(path) {}
+    // host functions visible to the script, registered before run
+    native_registry& natives() { return _natives; }
+
     void run() {
         auto debug_flag = std::getenv("VM_LUA_DEBUG");
         bool debug{false};
@@ -27,26 +43,208 @@ public:
             debug = true;
         }
 
-        lexer lexer(_file);
-        std::vector<token_t> tokens;
-        for (auto&& token : lexer) {
-            if (token.get()->has_value()) {
-                tokens.push_back(std::get<0>(token.get()->value()));
-            }
-        }
+        lexer lexer(_source);
+        auto tokens = lexer.tokenize();
         static const char *blue = "\033[34m", *red = "\033[31m", *green = "\033[32m", *reset = "\033[0m";
 
-        std::cout << blue << "[driver] finish lexing: " << reset << std::endl;
-        std::cout << "[driver] tokens:" << vmlua::to_string(tokens) << std::endl;
+        std::cout << blue << "[driver] finish lexing: " << reset << tokens.size() << " tokens, "
+                  << tokens.strings().size() << " distinct names and numbers, " << tokens.memory() << " bytes"
+                  << std::endl;
         parser parser(tokens);
         auto ast = parser.parse();
-        emitter emitter;
+        std::cout << blue << "[driver] finish parsing: " << reset << ast.size() << " statements, " << ast.memory()
+                  << " bytes of nodes" << std::endl;
+        if (flag_enabled("VM_LUA_CONSTFOLD")) {
+            const_folder folder;
+            auto stats = folder.optimize(ast);
+            std::cout << "[driver] constant folding: " << stats.folded << " folded, " << stats.propagated
+                      << " propagated, " << stats.pruned << " branches pruned" << std::endl;
+        }
+        auto aot_path = std::getenv("VM_LUA_AOT");
+        if (aot_path != NULL) {
+            compile_ahead_of_time(ast, aot_path);
+            return;
+        }
+        auto out = make_output();
+        if (use_register_engine()) {
+            run_register_engine(ast, *out);
+            return;
+        }
+        emitter emitter(numeric_flag("VM_LUA_INLINE_BUDGET", emitter::default_inline_budget), &_natives);
         auto prog = emitter.compile(ast);
+        linker linker;
+        linker.link(prog);
+        if (flag_enabled("VM_LUA_PEEPHOLE")) {
+            peephole peephole;
+            auto eliminated = peephole.optimize(prog);
+            std::cout << "[driver] peephole: " << eliminated << " instructions eliminated" << std::endl;
+        }
+        if (flag_enabled("VM_LUA_SUPERINST")) {
+            superinst superinst;
+            // VM_LUA_SUPERINST_PROFILE=path selects fusions by the executions
+            // in a histogram json of a training run with VM_LUA_SUPERINST=0,
+            // rather than estimated ones. VM_LUA_SUPERINST_MAX=n applies at
+            // most n fusions
+            auto profile_path = std::getenv("VM_LUA_SUPERINST_PROFILE");
+            std::vector<uint64_t> executions;
+            if (profile_path != NULL) {
+                std::ifstream profile(profile_path);
+                if (!profile) {
+                    throw std::runtime_error(std::string("cannot read profile ") + profile_path);
+                }
+                executions = superinst::read_executions(profile, prog);
+            } else {
+                executions = superinst::estimate_executions(prog);
+            }
+            auto selected = superinst.select(superinst.measure(prog, executions),
+                                             numeric_flag("VM_LUA_SUPERINST_MAX", superinst::default_max_fusions));
+            auto eliminated = superinst.fuse(prog, selected);
+            std::cout << "[driver] superinstructions: " << selected.size() << " fusions selected, " << eliminated
+                      << " instructions eliminated" << std::endl;
+        }
         std::cout << green << "[driver] finish compile" << reset << std::endl;
         vm vm;
-        vm.show_asm(prog);
+        // VM_LUA_TRACE=emitter writes the listing to stderr, see trace.h
+        VMLUA_TRACE_BLOCK(tc_emitter, tl_info, "listing:", [&](std::ostream& os) { vm.show_asm(os, prog); });
+        trace_flush();
+        std::cout << blue << "[driver] running" << reset << std::endl;
+        debugger dbg;
+        if (debug) {
+            vm.set_debugger(&dbg);
+        }
+        // VM_LUA_PROFILE=path samples every VM_LUA_PROFILE_INTERVAL instructions,
+        // or every VM_LUA_PROFILE_TIMER microseconds of cpu time, and writes the
+        // collapsed stacks to path
+        auto profile_path = std::getenv("VM_LUA_PROFILE");
+        std::unique_ptr<profiler> prof;
+        if (!debug && profile_path != NULL) {
+            auto timer = numeric_flag("VM_LUA_PROFILE_TIMER", 0);
+            auto mode = timer > 0 ? profiler::by_timer : profiler::by_instructions;
+            auto interval = timer > 0 ? timer : numeric_flag("VM_LUA_PROFILE_INTERVAL", profiler::default_interval);
+            prof = std::make_unique<profiler>(prog, mode, interval);
+            vm.set_debugger(prof.get());
+        }
+        auto instrumented = debug || prof != nullptr;
+#ifdef VMLUA_HISTOGRAM
+        // VM_LUA_HISTOGRAM=path counts executions per opcode, pc and opcode
+        // pair, shows them on the listing and writes them to path as json
+        auto histogram_path = std::getenv("VM_LUA_HISTOGRAM");
+        std::unique_ptr<histogram> hist;
+        if (!instrumented && histogram_path != NULL) {
+            hist = std::make_unique<histogram>(prog);
+            vm.set_debugger(hist.get());
+            instrumented = true;
+        }
+#endif
+        vm.set_output(out.get());
+        // VM_LUA_MEMO=1 caches the results of pure functions, opt-in as the
+        // tables take memory whether they help or not
+        auto memo_flag = std::getenv("VM_LUA_MEMO");
+        auto memo = memo_flag != NULL && memo_flag[0] == '1';
+        if (memo) {
+            vm.set_memo(numeric_flag("VM_LUA_MEMO_SIZE", memo_table::default_capacity));
+        }
+        // VM_LUA_JIT=1 compiles hot functions to machine code. the jit would
+        // bypass the debugger and the instrumentation, and calls between
+        // native functions are not memoized
+        auto jit_flag = std::getenv("VM_LUA_JIT");
+        std::unique_ptr<jit> native;
+        if (!instrumented && !memo && jit::supported() && jit_flag != NULL && jit_flag[0] == '1') {
+            native = std::make_unique<jit>(prog, vm, numeric_flag("VM_LUA_JIT_THRESHOLD", jit::default_threshold));
+            vm.set_call_hook(native.get());
+        }
+        vm.eval(prog);
+        if (native != nullptr) {
+            std::cout << "[driver] jit: " << native->compiled() << " functions compiled" << std::endl;
+        }
+        if (prof != nullptr) {
+            std::ofstream collapsed(profile_path);
+            prof->write_collapsed(collapsed);
+            prof->report(std::cout);
+            std::cout << "[driver] profile written to " << profile_path << std::endl;
+        }
+#ifdef VMLUA_HISTOGRAM
+        if (hist != nullptr) {
+            std::ofstream json(histogram_path);
+            hist->write_json(json, prog);
+            hist->show(vm, prog);
+            std::cout << "[driver] histogram written to " << histogram_path << std::endl;
+        }
+#endif
+        std::cout << green << "[driver] done!" << reset << std::endl;
+    }
+
+private:
+    // optimizations are on unless their variable is set to 0
+    static bool flag_enabled(const char* name) {
+        auto flag = std::getenv(name);
+        return flag == NULL || flag[0] != '0';
+    }
+    // tunables such as VM_LUA_INLINE_BUDGET=n, fallback unless set to a number
+    static size_t numeric_flag(const char* name, size_t fallback) {
+        auto flag = std::getenv(name);
+        if (flag == NULL || !std::isdigit(static_cast<unsigned char>(flag[0])) || !lb::string_util::is_number(flag)) {
+            return fallback;
+        }
+        return std::stoul(flag);
+    }
+    // VM_LUA_ENGINE=reg selects the register engine, default is the stack engine
+    static bool use_register_engine() {
+        auto engine_flag = std::getenv("VM_LUA_ENGINE");
+        return engine_flag != NULL && std::string(engine_flag) == "reg";
+    }
+    // VM_LUA_AOT=path writes path.cpp and builds it with $CXX into the executable
+    // path, or path.so exporting vmlua_main if VM_LUA_AOT_SHARED=1.
+    // VM_LUA_AOT_BUILD=0 only writes the source
+    void compile_ahead_of_time(const ast& ast, std::string const& path) {
+        static const char *green = "\033[32m", *reset = "\033[0m";
+        cpp_emitter emitter(&_natives);
+        auto source = path + ".cpp";
+        std::ofstream out(source);
+        out << emitter.compile(ast);
+        out.close();
+        if (!out) {
+            throw std::runtime_error("cannot write " + source);
+        }
+        std::cout << green << "[driver] wrote " << source << reset << std::endl;
+        if (!flag_enabled("VM_LUA_AOT_BUILD")) {
+            return;
+        }
+        auto shared_flag = std::getenv("VM_LUA_AOT_SHARED");
+        auto shared = shared_flag != NULL && shared_flag[0] == '1';
+        auto compiler = std::getenv("CXX");
+        auto output = shared ? path + ".so" : path;
+        if (cpp_emitter::build(source, output, shared, compiler != NULL ? compiler : "c++") != 0) {
+            throw std::runtime_error("failed to build " + output);
+        }
+        std::cout << green << "[driver] built " << output << reset << std::endl;
+    }
+    // VM_LUA_OUTPUT_BUFFER=n sets the print buffer size in bytes,
+    // VM_LUA_OUTPUT_FLUSH=line or full overrides flushing after every line
+    // only on terminals, VM_LUA_OUTPUT_THREAD=1 writes from a thread
+    static std::unique_ptr<output> make_output() {
+        auto policy = output::default_policy(stdout);
+        auto flush_flag = std::getenv("VM_LUA_OUTPUT_FLUSH");
+        if (flush_flag != NULL && std::string(flush_flag) == "line") {
+            policy = output::flush_line;
+        } else if (flush_flag != NULL && std::string(flush_flag) == "full") {
+            policy = output::flush_full;
+        }
+        auto thread_flag = std::getenv("VM_LUA_OUTPUT_THREAD");
+        auto threaded = thread_flag != NULL && thread_flag[0] == '1';
+        return std::make_unique<output>(stdout, numeric_flag("VM_LUA_OUTPUT_BUFFER", output::default_capacity),
+                                        policy, threaded);
+    }
+    void run_register_engine(const ast& ast, output& out) {
+        static const char *blue = "\033[34m", *green = "\033[32m", *reset = "\033[0m";
+        reg_emitter emitter(&_natives);
+        auto prog = emitter.compile(ast);
+        std::cout << green << "[driver] finish compile (register engine)" << reset << std::endl;
+        reg_vm vm;
+        vm.set_output(&out);
+        VMLUA_TRACE_BLOCK(tc_emitter, tl_info, "listing:", [&](std::ostream& os) { vm.show_asm(os, prog); });
+        trace_flush();
         std::cout << blue << "[driver] running" << reset << std::endl;
-        vm.set_debug(debug);
         vm.eval(prog);
         std::cout << green << "[driver] done!" << reset << std::endl;
     }
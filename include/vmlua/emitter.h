@@ -1,32 +1,83 @@
 #pragma once
+#include <set>
+
 #include "vm.h"
 namespace lb::vmlua {
 
 class emitter {
 public:
+    // ast nodes a function body may have to be inlined, 0 disables inlining
+    static constexpr size_t default_inline_budget = 16;
+
+private:
+    // return statements in functions may tail call, top level ones may not
+    bool _in_function{false};
+    // slots of the frame being compiled: its parameters and locals come
+    // first, numbered in order as if nothing were inlined, then the slots of
+    // the inlined bodies
+    size_t _slots{0};
+    size_t _declared_slots{0};
+    size_t _inline_slots{0};
+    size_t _inline_budget;
+    native_registry const* _natives;
+    size_t _inline_sites{0};
+    size_t _if_labels{0};
+    std::map<std::string, func_decl*> _inlinable;
+    // parameters of every function, of its first declaration like the linker
+    std::map<std::string, size_t> _arity;
+    std::set<std::string> _pure;
+    // where returns of the bodies being inlined jump to, innermost last
+    std::vector<std::string> _inline_exits;
+    // offset of the last label placed, labels only ever being placed at the
+    // end of the code
+    int32_t _last_label{-1};
+
+public:
+    explicit emitter(size_t inline_budget = default_inline_budget, native_registry const* natives = nullptr)
+        : _inline_budget(inline_budget), _natives(natives) {}
+
     program compile(const ast& ast) {
         program prog;
+        prog.natives = _natives;
         std::map<std::string, int32_t> locals;
+        _slots = 0;
+        _declared_slots = count_locals(ast.stmts());
+        _inline_slots = _declared_slots;
+        _inline_sites = 0;
+        _if_labels = 0;
+        _last_label = -1;
+        std::map<std::string, std::vector<func_decl*>> decls;
+        collect_functions(ast.stmts(), decls);
+        _arity.clear();
+        for (auto& decl : decls) {
+            if (_natives != nullptr) {
+                _natives->check_declaration(decl.first);
+            }
+            _arity.insert({decl.first, decl.second.front()->params.size()});
+        }
+        find_inlinable(ast);
+        find_pure(ast);
         for (auto&& stmt : ast) {
-            compile_statement(prog, locals, stmt.get());
+            compile_statement(prog, locals, stmt);
         }
+        prog.nlocals = _inline_slots;
+        VMLUA_TRACE(tc_emitter, tl_info,
+                    prog.insts.size() << " instructions, " << _inline_slots << " slots, " << _inline_sites << " calls inlined");
         return prog;
     }
 
     void compile_statement(program& prog, std::map<std::string, int32_t>& locals, stmt_t* stmt) {
-        if (auto* p = dynamic_cast<if_stmt*>(stmt)) {
-            compile_if(prog, locals, p);
-        } else if (auto* p = dynamic_cast<local_stmt*>(stmt)) {
-            compile_local(prog, locals, p);
-        } else if (auto* p = dynamic_cast<ret_stmt*>(stmt)) {
-            compile_ret(prog, locals, p);
-        } else if (auto* p = dynamic_cast<expr_stmt*>(stmt)) {
-            compile_expr(prog, locals, p);
-        } else if (auto* p = dynamic_cast<func_decl*>(stmt)) {
-            compile_func_decl(prog, locals, p);
-        } else {
-            throw std::runtime_error("unknown statement");
-        }
+        visit(stmt, overloaded{
+                        [&](if_stmt* p) { compile_if(prog, locals, p); },
+                        [&](local_stmt* p) { compile_local(prog, locals, p); },
+                        [&](ret_stmt* p) { compile_ret(prog, locals, p); },
+                        [&](expr_stmt* p) {
+                            compile_expr(prog, locals, p->expr);
+                            // every call leaves exactly one value behind
+                            prog.emit(op_pop);
+                        },
+                        [&](func_decl* p) { compile_func_decl(prog, locals, p); },
+                    });
     }
     void compile_if(program& prog, std::map<std::string, int32_t>& locals, if_stmt* stmt) {
         /**
@@ -42,140 +93,435 @@ public:
          *___z
          * */
 
-        auto label_else = lb::string_util::concat("label_else_", prog.insts.size());
-        auto label_out = lb::string_util::concat("label_out_", prog.insts.size());
+        // numbered, an inlined body may start an if at the same offset
+        auto id = _if_labels++;
+        auto label_else = lb::string_util::concat("label_else_", id);
+        auto label_out = lb::string_util::concat("label_out_", id);
 
-        auto cond = stmt->condition.get()->clone();
-        {
-            // condition
-            expr_stmt cond_expr(cond);
-            compile_expr(prog, locals, &cond_expr);
-        }
+        compile_expr(prog, locals, stmt->condition);
         // then body
-        prog.insts.push_back(std::make_unique<jump_if_zero_inst>(label_else));
+        prog.emit(op_jz, prog.label(label_else));
         for (auto&& stmt_ : stmt->then_body) {
-            compile_statement(prog, locals, stmt_.get());
+            compile_statement(prog, locals, stmt_);
         }
-        prog.insts.push_back(std::make_unique<jump_inst>(label_out));
+        prog.emit(op_jmp, prog.label(label_out));
         // else body
         // [label_else]:
-        symbol sym_label_else{static_cast<int32_t>(prog.insts.size()), 0, 0};
-        prog.syms.insert(std::make_pair(label_else, sym_label_else));
+        place_label(prog, label_else);
         for (auto&& stmt_ : stmt->else_body) {
-            compile_statement(prog, locals, stmt_.get());
+            compile_statement(prog, locals, stmt_);
         }
         // [label_out]:
-        symbol sym_label_out{static_cast<int32_t>(prog.insts.size()), 0, 0};
-        prog.syms.insert(std::make_pair(label_out, sym_label_out));
+        place_label(prog, label_out);
     }
     void compile_local(program& prog, std::map<std::string, int32_t>& locals, local_stmt* local) {
-        auto index = locals.size();
-        locals.insert(std::make_pair(local->name.literal, static_cast<int32_t>(index)));
-        auto expr_uptr = local->expr.get()->clone();
-        expr_stmt expr_tmp(expr_uptr);
-        compile_expr(prog, locals, &expr_tmp);
-        prog.insts.push_back(std::make_unique<move_plus_fp_inst>(index));
+        auto index = _inline_exits.empty() ? _slots++ : _inline_slots++;
+        locals.insert(std::make_pair(to_string(local->name), static_cast<int32_t>(index)));
+        compile_expr(prog, locals, local->expr);
+        prog.emit(op_move_plus_fp, static_cast<int32_t>(index));
     }
     void compile_literal(program& prog, std::map<std::string, int32_t>& locals, literal_t* lit) {
-        if (auto* p = dynamic_cast<literal_number*>(lit)) {
-            auto str = p->token.literal;
+        if (auto* p = node_cast<literal_number>(lit)) {
+            auto str = to_string(p->token);
             auto num = std::stoi(str);
-            prog.insts.push_back(std::make_unique<store_inst>(num));
-        } else if (auto* p = dynamic_cast<literal_id*>(lit)) {
-            prog.insts.push_back(std::make_unique<dup_plus_fp_inst>(locals[p->token.literal]));
+            prog.emit(op_store, num);
+        } else if (auto* p = node_cast<literal_id>(lit)) {
+            // unknown names read slot 0, without binding the name to it, or 0
+            // in a frame declaring nothing, like reg_emitter
+            auto it = locals.find(to_string(p->token));
+            if (it != locals.end()) {
+                prog.emit(op_dup_plus_fp, it->second);
+            } else if (_declared_slots > 0) {
+                prog.emit(op_dup_plus_fp, 0);
+            } else {
+                prog.emit(op_store, 0);
+            }
         } else {
             throw std::runtime_error("unknown literal");
         }
     }
-    void compile_function_call(program& prog, std::map<std::string, int32_t>& locals, func_call* fc) {
+    void compile_function_call(program& prog, std::map<std::string, int32_t>& locals, func_call* fc,
+                               bool tail = false) {
         auto len = fc->arguments.size();
-        for (auto&& arg : fc->arguments) {
-            auto tmp_uptr = arg.get()->clone();
-            expr_stmt expr_tmp(tmp_uptr);
-            compile_expr(prog, locals, &expr_tmp);
+        // builtins are resolved here, before any function of the same name
+        if (to_string(fc->name) == "print" || native_id(to_string(fc->name)) >= 0) {
+            compile_builtin_call(prog, locals, fc);
+            return;
+        }
+        auto inlined = _inlinable.find(to_string(fc->name));
+        if (inlined != _inlinable.end() && inlined->second->params.size() == len) {
+            compile_inline(prog, locals, fc, inlined->second);
+            return;
         }
-        prog.insts.push_back(std::make_unique<call_inst>(fc->name.literal, len));
+        // the callee binds the last nargs arguments, the ones before are
+        // evaluated for their effects only and do not stay on the stack
+        auto arity = _arity.find(to_string(fc->name));
+        auto surplus = arity != _arity.end() && arity->second < len ? len - arity->second : 0;
+        for (size_t i = 0; i < len; i++) {
+            compile_expr(prog, locals, fc->arguments[i]);
+            if (i < surplus) {
+                prog.emit(op_pop);
+            }
+        }
+        prog.emit(tail ? op_tailcall : op_call, prog.label(to_string(fc->name)), static_cast<uint16_t>(len - surplus));
     }
     void compile_binary_op(program& prog, std::map<std::string, int32_t>& locals, binary_op* op) {
-        auto tmp_uptr_l = op->left.get()->clone();
-        expr_stmt expr_tmp_l(tmp_uptr_l);
-        compile_expr(prog, locals, &expr_tmp_l);
-        auto tmp_uptr_r = op->right.get()->clone();
-        expr_stmt expr_tmp_r(tmp_uptr_r);
-        compile_expr(prog, locals, &expr_tmp_r);
-        auto oplit = op->op.literal;
+        compile_expr(prog, locals, op->left);
+        compile_expr(prog, locals, op->right);
+        auto oplit = to_string(op->op);
         if (oplit == "+") {
-            prog.insts.push_back(std::make_unique<add_inst>());
+            prog.emit(op_add);
         } else if (oplit == "-") {
-            prog.insts.push_back(std::make_unique<subtract_inst>());
+            prog.emit(op_sub);
         } else if (oplit == "<") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::LT));
+            prog.emit(op_cond, 0, 0, logical_op::LT);
         } else if (oplit == ">") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::GT));
+            prog.emit(op_cond, 0, 0, logical_op::GT);
         } else if (oplit == "<=") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::LE));
+            prog.emit(op_cond, 0, 0, logical_op::LE);
         } else if (oplit == ">=") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::GE));
+            prog.emit(op_cond, 0, 0, logical_op::GE);
         } else if (oplit == "==") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::EQ));
+            prog.emit(op_cond, 0, 0, logical_op::EQ);
         } else if (oplit == "!=") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::NE));
-        } else if (oplit == "&&" || oplit == "and ") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::AND));
-        } else if (oplit == "||" || oplit == "or ") {
-            prog.insts.push_back(std::make_unique<logic_cond_inst>(logical_op::OR));
+            prog.emit(op_cond, 0, 0, logical_op::NE);
+        } else if (oplit == "&&" || oplit == "and") {
+            prog.emit(op_cond, 0, 0, logical_op::AND);
+        } else if (oplit == "||" || oplit == "or") {
+            prog.emit(op_cond, 0, 0, logical_op::OR);
         } else {
             throw std::runtime_error("unknown operator");
         }
     }
     void compile_ret(program& prog, std::map<std::string, int32_t>& locals, ret_stmt* stmt) {
-        auto tmp_uptr = stmt->expr.get()->clone();
-        expr_stmt expr_tmp(tmp_uptr);
-        compile_expr(prog, locals, &expr_tmp);
-        prog.insts.push_back(std::make_unique<return_inst>());
-    }
-    void compile_expr(program& prog, std::map<std::string, int32_t>& locals, expr_stmt* expr) {
-        if (auto* p = dynamic_cast<literal_t*>(expr->expr.get())) {
-            compile_literal(prog, locals, p);
-        } else if (auto* p = dynamic_cast<func_call*>(expr->expr.get())) {
-            compile_function_call(prog, locals, p);
-        } else if (auto* p = dynamic_cast<binary_op*>(expr->expr.get())) {
-            compile_binary_op(prog, locals, p);
-        } else {
-            throw std::runtime_error("unknown expression");
+        if (!_inline_exits.empty()) {
+            compile_expr(prog, locals, stmt->expr);
+            prog.emit(op_jmp, prog.label(_inline_exits.back()));
+            return;
+        }
+        // return f(x) reuses the frame instead of calling and returning
+        auto* call = node_cast<func_call>(stmt->expr);
+        if (_in_function && call != nullptr && !is_builtin(to_string(call->name)) &&
+            _inlinable.find(to_string(call->name)) == _inlinable.end()) {
+            compile_function_call(prog, locals, call, true);
+            return;
         }
+        compile_expr(prog, locals, stmt->expr);
+        prog.emit(op_retval);
+    }
+    void compile_expr(program& prog, std::map<std::string, int32_t>& locals, expr_t* expr) {
+        visit(expr, overloaded{
+                        [&](literal_id* p) { compile_literal(prog, locals, p); },
+                        [&](literal_number* p) { compile_literal(prog, locals, p); },
+                        [&](func_call* p) { compile_function_call(prog, locals, p); },
+                        [&](binary_op* p) { compile_binary_op(prog, locals, p); },
+                    });
     }
     void compile_func_decl(program& prog, std::map<std::string, int32_t>& locals, func_decl* fd) {
         auto done_label = lb::string_util::concat("function_done_", prog.insts.size());
-        prog.insts.push_back(std::make_unique<jump_inst>(done_label));
+        prog.emit(op_jmp, prog.label(done_label));
 
         // scope visibility
         std::map<std::string, int32_t> new_locals;
 
+        // arguments are passed in place as the first locals
         auto func_index = static_cast<int32_t>(prog.insts.size());
         auto nargs = fd->params.size();
         for (auto i = 0; i < nargs; i++) {
-            auto param = fd->params[i].get();
-            prog.insts.push_back(std::make_unique<move_minus_fp_inst>(i, nargs - (i + 1)));
-            new_locals.insert({param->literal, static_cast<int32_t>(i)});
+            auto& param = fd->params[i];
+            new_locals.insert({to_string(param), static_cast<int32_t>(i)});
         }
 
+        auto in_function = _in_function;
+        auto slots = _slots, declared_slots = _declared_slots, inline_slots = _inline_slots;
+        _in_function = true;
+        _slots = nargs;
+        _declared_slots = nargs + count_locals(fd->body);
+        _inline_slots = _declared_slots;
         for (auto&& stmt : fd->body) {
-            compile_statement(prog, new_locals, stmt.get());
+            compile_statement(prog, new_locals, stmt);
+        }
+        auto nlocals = _inline_slots;
+        _in_function = in_function;
+        _slots = slots;
+        _declared_slots = declared_slots;
+        _inline_slots = inline_slots;
+        // if user forget to return, we need to add a return inst; a branch
+        // may also jump past the last return
+        auto falls_off = _last_label == static_cast<int32_t>(prog.insts.size());
+        auto back = prog.insts.back().op;
+        if ((back != op_ret && back != op_retval && back != op_tailcall) || falls_off) {
+            prog.emit(op_ret);
+        }
+
+        symbol sym_func{static_cast<int32_t>(func_index), nargs, nlocals, true, _pure.count(to_string(fd->name)) > 0};
+        prog.syms.insert(std::make_pair(to_string(fd->name), sym_func));
+
+        place_label(prog, done_label);
+    }
+
+private:
+    // puts label at the next instruction
+    void place_label(program& prog, std::string const& label) {
+        _last_label = static_cast<int32_t>(prog.insts.size());
+        prog.syms.insert(std::make_pair(label, symbol{_last_label, 0, 0}));
+    }
+    // -1 if name is not a registered native
+    int32_t native_id(std::string const& name) const { return _natives != nullptr ? _natives->find(name) : -1; }
+    bool is_builtin(std::string const& name) const { return name == "print" || native_id(name) >= 0; }
+
+    void compile_builtin_call(program& prog, std::map<std::string, int32_t>& locals, func_call* fc) {
+        auto len = fc->arguments.size();
+        auto id = native_id(to_string(fc->name));
+        if (id >= 0) {
+            _natives->check_call(id, len);
+        }
+        if (len > UINT16_MAX) {
+            throw std::runtime_error("too many arguments to " + to_string(fc->name));
         }
-        // if user forget to return, we need to add a return inst
-        auto& back = prog.insts.back();
-        if (auto* p = dynamic_cast<return_inst*>(back.get())) {
-            // do nothing
+        for (auto&& arg : fc->arguments) {
+            compile_expr(prog, locals, arg);
+        }
+        if (id >= 0) {
+            prog.emit(op_native, id, static_cast<uint16_t>(len));
         } else {
-            prog.insts.push_back(std::make_unique<return_inst>(false));
+            prog.emit(op_print, 0, static_cast<uint16_t>(len));
+        }
+    }
+
+    /**
+     * a call to an inlinable function compiles its body into the caller's
+     * frame. parameters and locals get fresh slots of the caller, which are
+     * zeroed on entry like the callee's would be and are written at most once
+     * per activation as there are no loops. a return leaves its value on the
+     * operand stack and jumps past the body:
+     *
+     *___<args>
+     *___POP FP + param n-1 .. POP FP + param 0
+     *___<body>, return x: <x>; JMP inline_done
+     *___PUSH 0
+     *_[inline_done]
+     */
+    void compile_inline(program& prog, std::map<std::string, int32_t>& locals, func_call* fc, func_decl* fd) {
+        for (auto&& arg : fc->arguments) {
+            compile_expr(prog, locals, arg);
+        }
+        std::map<std::string, int32_t> inner;
+        for (auto&& param : fd->params) {
+            inner.insert({to_string(param), static_cast<int32_t>(_inline_slots++)});
+        }
+        for (auto it = fd->params.rbegin(); it != fd->params.rend(); ++it) {
+            prog.emit(op_move_plus_fp, inner[to_string(*it)]);
+        }
+        auto done_label = lb::string_util::concat("inline_done_", _inline_sites++);
+        _inline_exits.push_back(done_label);
+        for (auto&& stmt : fd->body) {
+            compile_statement(prog, inner, stmt);
+        }
+        _inline_exits.pop_back();
+        // the value of a body falling off its end
+        prog.emit(op_store, 0);
+        place_label(prog, done_label);
+    }
+
+    static size_t node_count(expr_t* e) {
+        return visit(e, overloaded{
+                            [](func_call* p) {
+                                size_t n = 1;
+                                for (auto&& arg : p->arguments) {
+                                    n += node_count(arg);
+                                }
+                                return n;
+                            },
+                            [](binary_op* p) { return 1 + node_count(p->left) + node_count(p->right); },
+                            [](auto*) { return size_t{1}; },
+                        });
+    }
+
+    // sums the nodes of a body, collecting the functions it calls and the
+    // names it reads or declares. returns SIZE_MAX for nested functions
+    // locals a body declares, not looking into nested functions
+    static size_t count_locals(stmt_list const& body) {
+        size_t n = 0;
+        for (auto&& stmt : body) {
+            if (node_cast<local_stmt>(stmt) != nullptr) {
+                n++;
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                n += count_locals(p->then_body) + count_locals(p->else_body);
+            }
+        }
+        return n;
+    }
+
+    static size_t scan_body(stmt_list const& body, std::set<std::string>& callees,
+                            std::set<std::string>& reads, std::set<std::string>& declared) {
+        size_t n = 0;
+        std::function<void(expr_t*)> walk = [&](expr_t* e) {
+            visit(e, overloaded{
+                         [&](literal_id* p) { reads.insert(to_string(p->token)); },
+                         [&](func_call* p) {
+                             callees.insert(to_string(p->name));
+                             for (auto&& arg : p->arguments) {
+                                 walk(arg);
+                             }
+                         },
+                         [&](binary_op* p) {
+                             walk(p->left);
+                             walk(p->right);
+                         },
+                         [](literal_number*) {},
+                     });
+        };
+        for (auto&& stmt : body) {
+            auto m = visit(stmt, overloaded{
+                                     [&](local_stmt* p) -> size_t {
+                                         declared.insert(to_string(p->name));
+                                         walk(p->expr);
+                                         return 1 + node_count(p->expr);
+                                     },
+                                     [&](ret_stmt* p) -> size_t {
+                                         walk(p->expr);
+                                         return 1 + node_count(p->expr);
+                                     },
+                                     [&](expr_stmt* p) -> size_t {
+                                         walk(p->expr);
+                                         return 1 + node_count(p->expr);
+                                     },
+                                     [&](if_stmt* p) -> size_t {
+                                         walk(p->condition);
+                                         auto then_n = scan_body(p->then_body, callees, reads, declared);
+                                         auto else_n = scan_body(p->else_body, callees, reads, declared);
+                                         if (then_n == SIZE_MAX || else_n == SIZE_MAX) {
+                                             return SIZE_MAX;
+                                         }
+                                         return 1 + node_count(p->condition) + then_n + else_n;
+                                     },
+                                     [](func_decl*) -> size_t { return SIZE_MAX; },
+                                 });
+            if (m == SIZE_MAX) {
+                return SIZE_MAX;
+            }
+            n += m;
+        }
+        return n;
+    }
+
+    static void collect_functions(stmt_list const& stmts,
+                                  std::map<std::string, std::vector<func_decl*>>& decls) {
+        for (auto&& stmt : stmts) {
+            if (auto* p = node_cast<func_decl>(stmt)) {
+                decls[to_string(p->name)].push_back(p);
+                collect_functions(p->body, decls);
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                collect_functions(p->then_body, decls);
+                collect_functions(p->else_body, decls);
+            }
+        }
+    }
+
+    // a function is inlined if its body fits the budget, it is declared once,
+    // declares no functions itself, reads only its own parameters and locals,
+    // and cannot reach itself through calls
+    void find_inlinable(const ast& ast) {
+        _inlinable.clear();
+        if (_inline_budget == 0) {
+            return;
         }
+        std::map<std::string, std::vector<func_decl*>> decls;
+        collect_functions(ast.stmts(), decls);
+        std::map<std::string, std::set<std::string>> calls;
+        std::set<std::string> candidates;
+        for (auto& decl : decls) {
+            std::set<std::string> reads, declared;
+            auto* fd = decl.second.front();
+            auto size = scan_body(fd->body, calls[decl.first], reads, declared);
+            for (auto&& param : fd->params) {
+                declared.insert(to_string(param));
+            }
+            auto own_names = std::includes(declared.begin(), declared.end(), reads.begin(), reads.end());
+            if (decl.second.size() == 1 && size <= _inline_budget && own_names) {
+                candidates.insert(decl.first);
+            }
+        }
+        for (auto& name : candidates) {
+            std::set<std::string> seen;
+            std::vector<std::string> work(calls[name].begin(), calls[name].end());
+            auto recursive = false;
+            while (!work.empty() && !recursive) {
+                auto callee = work.back();
+                work.pop_back();
+                recursive = callee == name;
+                if (seen.insert(callee).second) {
+                    work.insert(work.end(), calls[callee].begin(), calls[callee].end());
+                }
+            }
+            if (!recursive) {
+                _inlinable.insert({name, decls[name].front()});
+            }
+            VMLUA_TRACE(tc_emitter, tl_debug, name << (recursive ? " is recursive, not inlined" : " is inlinable"));
+        }
+    }
 
-        symbol sym_func{static_cast<int32_t>(func_index), nargs, new_locals.size()};
-        prog.syms.insert(std::make_pair(fd->name.literal, sym_func));
+    // functions called in a body, not looking into nested functions
+    static void collect_calls(stmt_list const& body, std::set<std::string>& callees) {
+        std::function<void(expr_t*)> walk = [&](expr_t* e) {
+            visit(e, overloaded{
+                         [&](func_call* p) {
+                             callees.insert(to_string(p->name));
+                             for (auto&& arg : p->arguments) {
+                                 walk(arg);
+                             }
+                         },
+                         [&](binary_op* p) {
+                             walk(p->left);
+                             walk(p->right);
+                         },
+                         [](auto*) {},
+                     });
+        };
+        for (auto&& stmt : body) {
+            visit(stmt, overloaded{
+                            [&](local_stmt* p) { walk(p->expr); },
+                            [&](ret_stmt* p) { walk(p->expr); },
+                            [&](expr_stmt* p) { walk(p->expr); },
+                            [&](if_stmt* p) {
+                                walk(p->condition);
+                                collect_calls(p->then_body, callees);
+                                collect_calls(p->else_body, callees);
+                            },
+                            [](func_decl*) {},
+                        });
+        }
+    }
 
-        symbol sym_done_label{static_cast<int32_t>(prog.insts.size()), 0, 0};
-        prog.syms.insert(std::make_pair(done_label, sym_done_label));
+    // a function is pure if it never prints, calls no natives and calls only
+    // pure functions.
+    // frames are all a function can read, so its result then depends on its
+    // arguments alone. starts from every function and drops impure ones
+    // until nothing changes, which keeps recursive functions pure
+    void find_pure(const ast& ast) {
+        std::map<std::string, std::vector<func_decl*>> decls;
+        collect_functions(ast.stmts(), decls);
+        std::map<std::string, std::set<std::string>> calls;
+        _pure.clear();
+        for (auto& decl : decls) {
+            // the linker resolves a name to its first declaration
+            collect_calls(decl.second.front()->body, calls[decl.first]);
+            // calls to a builtin never reach a function of the same name
+            if (!is_builtin(decl.first)) {
+                _pure.insert(decl.first);
+            }
+        }
+        for (auto changed = true; changed;) {
+            changed = false;
+            for (auto& call : calls) {
+                auto impure = std::any_of(call.second.begin(), call.second.end(),
+                                          [this](std::string const& callee) { return _pure.count(callee) == 0; });
+                if (impure && _pure.erase(call.first) > 0) {
+                    changed = true;
+                }
+            }
+        }
     }
 };
 }  // namespace lb::vmlua
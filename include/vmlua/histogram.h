@@ -0,0 +1,112 @@
+#pragma once
+#include <ostream>
+
+#include "vm.h"
+namespace lb::vmlua {
+
+/**
+ * counts executions per opcode, per pc and per pair of opcodes executed one
+ * after the other at adjacent offsets, the pairs superinstructions could
+ * fuse. a jump or call to the next offset counts too, a return never does.
+ *
+ * only built with -DVMLUA_HISTOGRAM=ON, see CMakeLists.txt; it runs in the
+ * vm's instrumented dispatch loop like the debugger.
+ */
+class histogram : public debug_hook {
+private:
+    uint64_t _executed{0};
+    std::vector<uint64_t> _ops;
+    // indexed by first * opcode_count + second
+    std::vector<uint64_t> _pairs;
+    std::vector<uint64_t> _pcs;
+    int32_t _prev_pc{-1};
+    opcode _prev_op{opcode_count};
+
+public:
+    explicit histogram(program const& prog)
+        : _ops(opcode_count, 0), _pairs(opcode_count * opcode_count, 0), _pcs(prog.insts.size(), 0) {}
+
+    bool before(vm& vm, program& prog) override {
+        auto pc = vm.program_counter();
+        auto op = prog.insts[pc].op;
+        _executed++;
+        _ops[op]++;
+        _pcs[pc]++;
+        if (_prev_op != opcode_count && pc == _prev_pc + 1) {
+            _pairs[_prev_op * opcode_count + op]++;
+        }
+        _prev_pc = pc;
+        _prev_op = op;
+        return true;
+    }
+
+    // executions of every offset, a profile superinst can select fusions by
+    std::vector<uint64_t> const& pc_counts() const { return _pcs; }
+
+    // the show_asm listing with the executions of every instruction in front,
+    // then the most executed opcodes and pairs
+    void show(vm& vm, program& prog, size_t top = 10) const {
+        vm.show_asm(prog, 0, INT32_MAX, &_pcs);
+        std::cout << "[histogram] " << _executed << " instructions executed" << '\n';
+        for (auto& entry : sorted_ops(top)) {
+            std::cout << std::setw(12) << entry.second << "  " << to_string(entry.first) << '\n';
+        }
+        for (auto& entry : sorted_pairs(top)) {
+            std::cout << std::setw(12) << entry.second << "  " << to_string(entry.first.first) << " "
+                      << to_string(entry.first.second) << '\n';
+        }
+    }
+
+    void write_json(std::ostream& out, program const& prog) const {
+        out << "{\n  \"executed\": " << _executed << ",\n  \"opcodes\": {";
+        auto ops = sorted_ops(SIZE_MAX);
+        for (size_t i = 0; i < ops.size(); i++) {
+            out << (i == 0 ? "\n" : ",\n") << "    \"" << to_string(ops[i].first) << "\": " << ops[i].second;
+        }
+        out << "\n  },\n  \"pairs\": [";
+        auto pairs = sorted_pairs(SIZE_MAX);
+        for (size_t i = 0; i < pairs.size(); i++) {
+            out << (i == 0 ? "\n" : ",\n") << "    {\"first\": \"" << to_string(pairs[i].first.first)
+                << "\", \"second\": \"" << to_string(pairs[i].first.second) << "\", \"count\": " << pairs[i].second
+                << "}";
+        }
+        out << "\n  ],\n  \"pcs\": [";
+        auto first = true;
+        for (int32_t pc = 0; pc < prog.insts.size(); pc++) {
+            if (_pcs[pc] == 0) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    {\"pc\": " << pc << ", \"op\": \"" << to_string(prog.insts[pc].op)
+                << "\", \"count\": " << _pcs[pc] << "}";
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    std::vector<std::pair<opcode, uint64_t>> sorted_ops(size_t top) const {
+        std::vector<std::pair<opcode, uint64_t>> ops;
+        for (size_t op = 0; op < opcode_count; op++) {
+            if (_ops[op] > 0) {
+                ops.push_back({static_cast<opcode>(op), _ops[op]});
+            }
+        }
+        std::stable_sort(ops.begin(), ops.end(), [](auto const& l, auto const& r) { return l.second > r.second; });
+        ops.resize(std::min(ops.size(), top));
+        return ops;
+    }
+
+    std::vector<std::pair<std::pair<opcode, opcode>, uint64_t>> sorted_pairs(size_t top) const {
+        std::vector<std::pair<std::pair<opcode, opcode>, uint64_t>> pairs;
+        for (size_t i = 0; i < _pairs.size(); i++) {
+            if (_pairs[i] > 0) {
+                auto first = static_cast<opcode>(i / opcode_count), second = static_cast<opcode>(i % opcode_count);
+                pairs.push_back({{first, second}, _pairs[i]});
+            }
+        }
+        std::stable_sort(pairs.begin(), pairs.end(), [](auto const& l, auto const& r) { return l.second > r.second; });
+        pairs.resize(std::min(pairs.size(), top));
+        return pairs;
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,653 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+
+#include "vm.h"
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define VMLUA_JIT_X64 1
+#endif
+
+namespace lb::vmlua {
+
+class jit;
+
+// state shared with native code, which addresses it through r13
+struct jit_state {
+    int32_t* stack_end;
+    uint32_t depth;
+    uint32_t max_depth;
+    int32_t error;
+    jit* owner;
+};
+
+/**
+ * baseline jit for x86-64: a function called more than threshold times is
+ * translated to native code, one template per opcode, superinstructions
+ * included. the operand stack depth is known at every offset, so operands
+ * are addressed at fixed offsets from the frame and never moved through a
+ * stack pointer.
+ *
+ * native functions are called as int32_t fn(int32_t* frame, jit_state*,
+ * int32_t target) with their arguments in place at frame, like the
+ * interpreter's. calls between them go through a table holding either native
+ * code or a trampoline back into the interpreter, so functions that are not
+ * hot yet (or could not be compiled) keep running interpreted.
+ *
+ * native frames live on the machine stack, so exceptions cannot cross them:
+ * errors are left in jit_state::error and native code returns at once after
+ * any call that set it, until call rethrows it in the interpreter.
+ */
+class jit : public call_hook {
+public:
+    static constexpr uint32_t default_threshold = 100;
+    // native frames take 32 bytes of machine stack each
+    static constexpr uint32_t default_max_depth = 1 << 16;
+    // interpreter runs nested in native code, which take far more
+    static constexpr uint32_t max_reentry = 1 << 10;
+
+    using native_fn = int32_t (*)(int32_t* frame, jit_state* state, int32_t target);
+
+    static bool supported() {
+#ifdef VMLUA_JIT_X64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    jit(program& prog, vm& vm, uint32_t threshold = default_threshold, uint32_t max_depth = default_max_depth)
+        : _prog(prog), _vm(vm), _threshold(threshold) {
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before jit");
+        }
+        _state = jit_state{vm.stack_end(), 0, max_depth, no_error, this};
+        _ids.assign(prog.insts.size(), no_function);
+        for (auto& inst : prog.insts) {
+            if ((inst.op == op_call || inst.op == op_tailcall) && _ids[inst.a] == no_function) {
+                _ids[inst.a] = static_cast<int32_t>(_functions.size());
+                _functions.push_back(function{inst.a, inst.b, inst.c});
+            }
+        }
+        _entries.assign(_functions.size(), reinterpret_cast<void*>(&trampoline));
+    }
+    ~jit() {
+#ifdef VMLUA_JIT_X64
+        for (auto& fn : _functions) {
+            if (fn.code != nullptr) {
+                munmap(fn.code, fn.code_size);
+            }
+        }
+#endif
+    }
+    jit(const jit&) = delete;
+    jit& operator=(const jit&) = delete;
+
+    bool call(int32_t target, int32_t* args, int32_t& result) override {
+        auto id = _ids[target];
+        if (id < 0 || !promote(_functions[id])) {
+            return false;
+        }
+        result = _functions[id].native(args, &_state, target);
+        if (_state.error != no_error) {
+            auto error = _state.error;
+            _state.error = no_error;
+            throw std::runtime_error(error_message(error));
+        }
+        return true;
+    }
+
+    size_t compiled() const {
+        return std::count_if(_functions.begin(), _functions.end(),
+                             [](function const& fn) { return fn.native != nullptr; });
+    }
+
+private:
+    enum error_code : int32_t { no_error, err_value_stack, err_frames, err_interpreter };
+
+    struct function {
+        int32_t loc;
+        uint8_t nargs;
+        uint16_t nlocals;
+        uint32_t calls{0};
+        bool failed{false};
+        native_fn native{nullptr};
+        void* code{nullptr};
+        size_t code_size{0};
+    };
+
+    program& _prog;
+    vm& _vm;
+    uint32_t _threshold;
+    jit_state _state;
+    std::vector<function> _functions;
+    // indexed like _functions, never resized as native code points into it
+    std::vector<void*> _entries;
+    // index in _functions of the function at each offset, so that a call
+    // costs the interpreter two loads, the second finding failed functions
+    std::vector<int32_t> _ids;
+    static constexpr int32_t no_function = -1;
+    uint32_t _reentry{0};
+    std::string _message;
+
+    std::string error_message(int32_t error) const {
+        switch (error) {
+            case err_value_stack:
+                return "stack overflow: value stack exhausted";
+            case err_frames:
+                return "stack overflow: too many nested calls";
+            default:
+                return _message;
+        }
+    }
+
+    // counts a call, compiling the function once it is hot
+    bool promote(function& fn) {
+        if (fn.native == nullptr && !fn.failed && ++fn.calls >= _threshold) {
+            fn.failed = !compile(fn);
+        }
+        return fn.native != nullptr;
+    }
+
+    // entry of functions without native code, called from native code
+    static int32_t trampoline(int32_t* frame, jit_state* state, int32_t target) {
+        auto* self = state->owner;
+        try {
+            auto& fn = self->_functions[self->_ids[target]];
+            if (self->promote(fn)) {
+                return fn.native(frame, state, target);
+            }
+            if (self->_reentry == max_reentry) {
+                state->error = err_frames;
+                return 0;
+            }
+            self->_reentry++;
+            scope_guard guard([self]() { self->_reentry--; });
+            return self->_vm.call(self->_prog, target, frame, fn.nargs, fn.nlocals);
+        } catch (std::exception const& e) {
+            self->_message = e.what();
+            state->error = err_interpreter;
+            return 0;
+        }
+    }
+
+    static void print_values(int32_t* top, uint32_t argc, jit_state* state) {
+        auto& out = state->owner->_vm.output_sink();
+        for (uint32_t i = 0; i < argc; i++) {
+            out.write(top[-1 - static_cast<int32_t>(i)]);
+            out.put(' ');
+        }
+        out.end_line();
+    }
+
+    // natives may throw, which cannot cross native frames
+    static int32_t call_native(int32_t* args, jit_state* state, int32_t id, uint32_t argc) {
+        auto* self = state->owner;
+        try {
+            return (*self->_prog.natives)[id].fn(args, argc);
+        } catch (std::exception const& e) {
+            self->_message = e.what();
+            state->error = err_interpreter;
+            return 0;
+        }
+    }
+
+    // values popped and pushed by an instruction, false if not supported
+    static bool stack_effect(instruction const& inst, int32_t& pops, int32_t& pushes) {
+        switch (inst.op) {
+            case op_add:
+            case op_sub:
+            case op_cond:
+                pops = 2, pushes = 1;
+                return true;
+            case op_dup_plus_fp:
+            case op_store:
+            case op_add_fp_k:
+            case op_sub_fp_k:
+            case op_add_fp_fp:
+            case op_cond_fp_fp:
+            case op_cond_fp_k:
+                pops = 0, pushes = 1;
+                return true;
+            case op_push_fp2:
+            case op_push_fp_k:
+                pops = 0, pushes = 2;
+                return true;
+            case op_move_plus_fp:
+            case op_pop:
+            case op_retval:
+            case op_jnz:
+            case op_jz:
+                pops = 1, pushes = 0;
+                return true;
+            case op_jncond:
+                pops = 2, pushes = 0;
+                return true;
+            case op_ret:
+            case op_jmp:
+            case op_ret_fp:
+            case op_ret_k:
+            case op_ret_add_fp_fp:
+                pops = 0, pushes = 0;
+                return true;
+            case op_call:
+                pops = inst.b, pushes = 1;
+                return true;
+            case op_tailcall:
+                pops = inst.b, pushes = 0;
+                return true;
+            case op_print:
+            case op_native:
+                pops = inst.c, pushes = 1;
+                return true;
+            case op_print_pop:
+                pops = inst.c, pushes = 0;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool terminates(opcode op) {
+        return op == op_ret || op == op_retval || op == op_jmp || op == op_tailcall || op == op_ret_fp ||
+               op == op_ret_k || op == op_ret_add_fp_fp;
+    }
+    static bool jumps(opcode op) { return op == op_jnz || op == op_jz || op == op_jmp || op == op_jncond; }
+
+    // operand stack depth before each instruction of the function at loc,
+    // false if some offset is reached with different depths
+    bool stack_depths(int32_t loc, std::map<int32_t, int32_t>& depths, int32_t& max_depth) const {
+        std::vector<std::pair<int32_t, int32_t>> work{{loc, 0}};
+        max_depth = 0;
+        while (!work.empty()) {
+            auto [pc, depth] = work.back();
+            work.pop_back();
+            if (pc < 0 || pc >= _prog.insts.size()) {
+                return false;
+            }
+            auto it = depths.find(pc);
+            if (it != depths.end()) {
+                if (it->second != depth) {
+                    return false;
+                }
+                continue;
+            }
+            depths.insert({pc, depth});
+            auto& inst = _prog.insts[pc];
+            int32_t pops, pushes;
+            if (!stack_effect(inst, pops, pushes) || depth < pops) {
+                return false;
+            }
+            // the push_* superinstructions and calls read before they write
+            max_depth = std::max(max_depth, depth + pushes);
+            auto next = depth - pops + pushes;
+            if (jumps(inst.op)) {
+                work.push_back({inst.a, next});
+            }
+            if (!terminates(inst.op)) {
+                work.push_back({pc + 1, next});
+            }
+        }
+        return true;
+    }
+
+#ifdef VMLUA_JIT_X64
+    // x86-64 encodings, eax is the only scratch register of the templates:
+    // rbx holds the frame, r13 the jit_state
+    struct assembler {
+        std::vector<uint8_t> code;
+
+        size_t size() const { return code.size(); }
+        void bytes(std::initializer_list<uint8_t> bs) { code.insert(code.end(), bs); }
+        void imm32(int32_t v) {
+            uint8_t b[4];
+            std::memcpy(b, &v, sizeof(b));
+            code.insert(code.end(), b, b + sizeof(b));
+        }
+        void imm64(uint64_t v) {
+            uint8_t b[8];
+            std::memcpy(b, &v, sizeof(b));
+            code.insert(code.end(), b, b + sizeof(b));
+        }
+        void patch32(size_t at, int32_t v) { std::memcpy(&code[at], &v, sizeof(v)); }
+
+        // <op> eax, [rbx + disp] (or the reverse for stores)
+        void frame_op(uint8_t op, int32_t disp) {
+            bytes({op, 0x83});
+            imm32(disp);
+        }
+        void load(int32_t disp) { frame_op(0x8B, disp); }
+        void store(int32_t disp) { frame_op(0x89, disp); }
+        void store_imm(int32_t disp, int32_t v) {
+            bytes({0xC7, 0x83});
+            imm32(disp);
+            imm32(v);
+        }
+        // <op> eax, imm32
+        void imm_op(uint8_t op, int32_t v) {
+            bytes({op});
+            imm32(v);
+        }
+        // <op> dword [r13 + disp8]
+        void state_op(std::initializer_list<uint8_t> op, uint8_t field) {
+            bytes(op);
+            bytes({field});
+        }
+        void lea_rdi(int32_t disp) {
+            bytes({0x48, 0x8D, 0xBB});
+            imm32(disp);
+        }
+        void mov_rax(uint64_t v) {
+            bytes({0x48, 0xB8});
+            imm64(v);
+        }
+        void pop_saved() { bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B}); }
+        // returns the offset of the rel32 to patch
+        size_t jcc(uint8_t cc) {
+            bytes({0x0F, static_cast<uint8_t>(0x80 | cc)});
+            imm32(0);
+            return size() - 4;
+        }
+        size_t jmp() {
+            bytes({0xE9});
+            imm32(0);
+            return size() - 4;
+        }
+    };
+
+    static constexpr uint8_t cc_e = 0x4, cc_ne = 0x5, cc_ae = 0x3, cc_a = 0x7;
+
+    static bool condition_code(logical_op op, uint8_t& cc) {
+        static const uint8_t codes[] = {0, 0, 0xC /*l*/, 0xF /*g*/, 0xE /*le*/, 0xD /*ge*/, cc_e, cc_ne};
+        cc = codes[op];
+        return op != AND && op != OR;
+    }
+
+    // right operand of an alu template: a frame slot or an immediate
+    struct operand {
+        bool imm;
+        int32_t v;
+    };
+    // eax = eax <op> right, op indexes add, sub, and, or, cmp
+    enum alu { alu_add, alu_sub, alu_and, alu_or, alu_cmp };
+    static void emit_alu(assembler& as, alu op, operand right) {
+        static const uint8_t mem_ops[] = {0x03, 0x2B, 0x23, 0x0B, 0x3B};
+        static const uint8_t imm_ops[] = {0x05, 0x2D, 0x25, 0x0D, 0x3D};
+        if (right.imm) {
+            as.imm_op(imm_ops[op], right.v);
+        } else {
+            as.frame_op(mem_ops[op], right.v);
+        }
+    }
+    // eax = left <cond> right
+    static void emit_cond(assembler& as, logical_op cond, int32_t left, operand right) {
+        as.load(left);
+        uint8_t cc;
+        if (!condition_code(cond, cc)) {
+            emit_alu(as, cond == AND ? alu_and : alu_or, right);
+            return;
+        }
+        emit_alu(as, alu_cmp, right);
+        as.bytes({0x0F, static_cast<uint8_t>(0x90 | cc), 0xC0, 0x0F, 0xB6, 0xC0});
+    }
+#endif
+
+    bool compile(function& fn) {
+#ifdef VMLUA_JIT_X64
+        std::map<int32_t, int32_t> depths;
+        int32_t max_depth;
+        if (!stack_depths(fn.loc, depths, max_depth)) {
+            return false;
+        }
+        static constexpr uint8_t state_stack_end = offsetof(jit_state, stack_end);
+        static constexpr uint8_t state_depth = offsetof(jit_state, depth);
+        static constexpr uint8_t state_max_depth = offsetof(jit_state, max_depth);
+        static constexpr uint8_t state_error = offsetof(jit_state, error);
+        auto local = [](int32_t slot) { return slot * 4; };
+        auto operand_slot = [&fn](int32_t depth) { return (fn.nlocals + depth) * 4; };
+
+        assembler as;
+        // (rel32 offset, target pc) and (rel32 offset, stub) pairs
+        std::vector<std::pair<size_t, int32_t>> jumps;
+        std::vector<size_t> to_epilogue, to_value_stack, to_frames;
+        std::map<int32_t, size_t> labels;
+
+        // push r12 only keeps the machine stack 16-byte aligned
+        as.bytes({0x53, 0x41, 0x54, 0x41, 0x55});
+        as.bytes({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF5});  // mov rbx, rdi; mov r13, rsi
+        as.bytes({0x48, 0x8D, 0x83});                    // lea rax, [rbx + frame size]
+        as.imm32(operand_slot(max_depth));
+        as.state_op({0x49, 0x3B, 0x45}, state_stack_end);  // cmp rax, [r13 + stack_end]
+        to_value_stack.push_back(as.jcc(cc_a));
+        as.state_op({0x41, 0x8B, 0x45}, state_depth);      // mov eax, [r13 + depth]
+        as.state_op({0x41, 0x3B, 0x45}, state_max_depth);  // cmp eax, [r13 + max_depth]
+        to_frames.push_back(as.jcc(cc_ae));
+        as.state_op({0x41, 0xFF, 0x45}, state_depth);  // inc dword [r13 + depth]
+
+        // self tail calls come back here
+        auto body = as.size();
+        auto zeroed = static_cast<int32_t>(fn.nlocals) - fn.nargs;
+        if (zeroed <= 8) {
+            for (int32_t i = fn.nargs; i < fn.nlocals; i++) {
+                as.store_imm(local(i), 0);
+            }
+        } else {
+            as.lea_rdi(local(fn.nargs));
+            as.imm_op(0xB9, zeroed);                // mov ecx, zeroed
+            as.bytes({0x31, 0xC0, 0xF3, 0xAB});     // xor eax, eax; rep stosd
+        }
+
+        for (auto& [pc, depth] : depths) {
+            labels[pc] = as.size();
+            auto& inst = _prog.insts[pc];
+            auto top = operand_slot(depth - 1), second = operand_slot(depth - 2), push = operand_slot(depth);
+            switch (inst.op) {
+                case op_add:
+                case op_sub:
+                    as.load(second);
+                    emit_alu(as, inst.op == op_add ? alu_add : alu_sub, operand{false, top});
+                    as.store(second);
+                    break;
+                case op_cond:
+                    emit_cond(as, static_cast<logical_op>(inst.b), second, operand{false, top});
+                    as.store(second);
+                    break;
+                case op_dup_plus_fp:
+                    as.load(local(inst.a));
+                    as.store(push);
+                    break;
+                case op_move_plus_fp:
+                    as.load(top);
+                    as.store(local(inst.a));
+                    break;
+                case op_store:
+                    as.store_imm(push, inst.a);
+                    break;
+                case op_pop:
+                    break;
+                case op_ret:
+                    as.bytes({0x31, 0xC0});
+                    to_epilogue.push_back(as.jmp());
+                    break;
+                case op_retval:
+                    as.load(top);
+                    to_epilogue.push_back(as.jmp());
+                    break;
+                case op_jnz:
+                case op_jz:
+                    as.load(top);
+                    as.bytes({0x85, 0xC0});  // test eax, eax
+                    jumps.push_back({as.jcc(inst.op == op_jz ? cc_e : cc_ne), inst.a});
+                    break;
+                case op_jmp:
+                    jumps.push_back({as.jmp(), inst.a});
+                    break;
+                case op_call: {
+                    auto args = operand_slot(depth - inst.b);
+                    as.lea_rdi(args);
+                    as.bytes({0x4C, 0x89, 0xEE});  // mov rsi, r13
+                    as.imm_op(0xBA, inst.a);        // mov edx, target
+                    as.mov_rax(reinterpret_cast<uint64_t>(&_entries[_ids[inst.a]]));
+                    as.bytes({0xFF, 0x10});                         // call [rax]
+                    as.state_op({0x41, 0x83, 0x7D}, state_error);  // cmp dword [r13 + error], 0
+                    as.bytes({0x00});
+                    to_epilogue.push_back(as.jcc(cc_ne));
+                    as.store(args);
+                    break;
+                }
+                case op_tailcall: {
+                    auto args = operand_slot(depth - inst.b);
+                    for (int32_t i = 0; i < inst.b; i++) {
+                        as.load(args + local(i));
+                        as.store(local(i));
+                    }
+                    if (inst.a == fn.loc) {
+                        auto at = as.jmp();
+                        as.patch32(at, static_cast<int32_t>(body - (at + 4)));
+                        break;
+                    }
+                    as.bytes({0x48, 0x89, 0xDF, 0x4C, 0x89, 0xEE});  // mov rdi, rbx; mov rsi, r13
+                    as.imm_op(0xBA, inst.a);                          // mov edx, target
+                    as.state_op({0x41, 0xFF, 0x4D}, state_depth);     // dec dword [r13 + depth]
+                    as.mov_rax(reinterpret_cast<uint64_t>(&_entries[_ids[inst.a]]));
+                    as.pop_saved();
+                    as.bytes({0xFF, 0x20});  // jmp [rax]
+                    break;
+                }
+                case op_print:
+                case op_print_pop:
+                    as.lea_rdi(push);
+                    as.imm_op(0xBE, inst.c);       // mov esi, argc
+                    as.bytes({0x4C, 0x89, 0xEA});  // mov rdx, r13
+                    as.mov_rax(reinterpret_cast<uint64_t>(&print_values));
+                    as.bytes({0xFF, 0xD0});  // call rax
+                    if (inst.op == op_print) {
+                        as.store_imm(operand_slot(depth - inst.c), 0);
+                    }
+                    break;
+                case op_native: {
+                    auto args = operand_slot(depth - inst.c);
+                    as.lea_rdi(args);
+                    as.bytes({0x4C, 0x89, 0xEE});  // mov rsi, r13
+                    as.imm_op(0xBA, inst.a);        // mov edx, id
+                    as.imm_op(0xB9, inst.c);        // mov ecx, argc
+                    as.mov_rax(reinterpret_cast<uint64_t>(&call_native));
+                    as.bytes({0xFF, 0xD0});                         // call rax
+                    as.state_op({0x41, 0x83, 0x7D}, state_error);  // cmp dword [r13 + error], 0
+                    as.bytes({0x00});
+                    to_epilogue.push_back(as.jcc(cc_ne));
+                    as.store(args);
+                    break;
+                }
+                case op_push_fp2:
+                    as.load(local(inst.c));
+                    as.store(push);
+                    as.load(local(inst.a));
+                    as.store(push + 4);
+                    break;
+                case op_push_fp_k:
+                    as.load(local(inst.c));
+                    as.store(push);
+                    as.store_imm(push + 4, inst.a);
+                    break;
+                case op_add_fp_k:
+                case op_sub_fp_k:
+                    as.load(local(inst.c));
+                    emit_alu(as, inst.op == op_add_fp_k ? alu_add : alu_sub, operand{true, inst.a});
+                    as.store(push);
+                    break;
+                case op_add_fp_fp:
+                    as.load(local(inst.c));
+                    emit_alu(as, alu_add, operand{false, local(inst.a)});
+                    as.store(push);
+                    break;
+                case op_cond_fp_fp:
+                    emit_cond(as, static_cast<logical_op>(inst.b), local(inst.c), operand{false, local(inst.a)});
+                    as.store(push);
+                    break;
+                case op_cond_fp_k:
+                    emit_cond(as, static_cast<logical_op>(inst.b), local(inst.c), operand{true, inst.a});
+                    as.store(push);
+                    break;
+                case op_jncond: {
+                    auto cond = static_cast<logical_op>(inst.b);
+                    uint8_t cc;
+                    as.load(second);
+                    if (condition_code(cond, cc)) {
+                        emit_alu(as, alu_cmp, operand{false, top});
+                        jumps.push_back({as.jcc(cc ^ 1), inst.a});
+                    } else {
+                        emit_alu(as, cond == AND ? alu_and : alu_or, operand{false, top});
+                        jumps.push_back({as.jcc(cc_e), inst.a});
+                    }
+                    break;
+                }
+                case op_ret_fp:
+                    as.load(local(inst.a));
+                    to_epilogue.push_back(as.jmp());
+                    break;
+                case op_ret_k:
+                    as.imm_op(0xB8, inst.a);  // mov eax, imm32
+                    to_epilogue.push_back(as.jmp());
+                    break;
+                case op_ret_add_fp_fp:
+                    as.load(local(inst.c));
+                    emit_alu(as, alu_add, operand{false, local(inst.a)});
+                    to_epilogue.push_back(as.jmp());
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        auto epilogue = as.size();
+        as.state_op({0x41, 0xFF, 0x4D}, state_depth);  // dec dword [r13 + depth]
+        as.pop_saved();
+        as.bytes({0xC3});
+        auto error_stub = [&as](int32_t error) {
+            auto at = as.size();
+            as.state_op({0x41, 0xC7, 0x45}, state_error);  // mov dword [r13 + error], error
+            as.imm32(error);
+            as.bytes({0x31, 0xC0});
+            as.pop_saved();
+            as.bytes({0xC3});
+            return at;
+        };
+        auto value_stack = error_stub(err_value_stack);
+        auto frames = error_stub(err_frames);
+
+        auto patch = [&as](size_t at, size_t to) { as.patch32(at, static_cast<int32_t>(to - (at + 4))); };
+        for (auto& jump : jumps) {
+            patch(jump.first, labels.at(jump.second));
+        }
+        for (auto at : to_epilogue) {
+            patch(at, epilogue);
+        }
+        for (auto at : to_value_stack) {
+            patch(at, value_stack);
+        }
+        for (auto at : to_frames) {
+            patch(at, frames);
+        }
+
+        auto size = as.size();
+        auto* code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            return false;
+        }
+        std::memcpy(code, as.code.data(), size);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, size);
+            return false;
+        }
+        fn.code = code;
+        fn.code_size = size;
+        fn.native = reinterpret_cast<native_fn>(code);
+        _entries[_ids[fn.loc]] = code;
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+}  // namespace lb::vmlua
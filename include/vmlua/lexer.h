@@ -1,290 +1,281 @@
 #pragma once
-#include <fstream>
-#include <functional>
-#include <iostream>
-#include <memory>
-#include <optional>
-#include <tuple>
-#include <vector>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string_view>
 
+#include "source.h"
+#include "tokens.h"
+#include "trace.h"
 #include "types.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VMLUA_LEXER_SSE2 1
+#endif
+
 namespace lb::vmlua {
-class lexer {
-public:
-    using token_yield = std::optional<std::tuple<token_t, location>>;
 
-private:
-    std::ifstream &_file;
-    location _loc;
-    token_yield _begin_token;
-    location eat_whitespace() {
-        auto c = _file.get();
-        auto next_loc = _loc;
-        auto flag = false;
-        while (std::isspace(static_cast<u_char>(c))) {
-            flag = true;
-            next_loc = next_loc.step(c == '\n');
-            if (_file.peek() == EOF) {
-                break;
+// what a character can start, or continue for identifiers and digits
+enum char_class : uint8_t {
+    cc_other,
+    cc_space,
+    cc_alpha,    // letters and '_'
+    cc_digit,
+    cc_syntax,   // ; ( ) ,
+    cc_equal,    // = or ==
+    cc_compare,  // < <= > >=
+    cc_bang,     // !=
+    cc_arith,    // * / ^ %
+    cc_plus,
+    cc_minus,
+};
+
+constexpr std::array<uint8_t, 256> char_classes = []() {
+    std::array<uint8_t, 256> classes{};
+    for (auto c : std::string_view(" \t\n\v\f\r")) {
+        classes[static_cast<unsigned char>(c)] = cc_space;
+    }
+    for (auto c = 'a'; c <= 'z'; c++) {
+        classes[c] = cc_alpha;
+        classes[c - 'a' + 'A'] = cc_alpha;
+    }
+    classes['_'] = cc_alpha;
+    for (auto c = '0'; c <= '9'; c++) {
+        classes[c] = cc_digit;
+    }
+    for (auto c : std::string_view(";(),")) {
+        classes[c] = cc_syntax;
+    }
+    for (auto c : std::string_view("*/^%")) {
+        classes[c] = cc_arith;
+    }
+    classes['='] = cc_equal;
+    classes['<'] = cc_compare;
+    classes['>'] = cc_compare;
+    classes['!'] = cc_bang;
+    classes['+'] = cc_plus;
+    classes['-'] = cc_minus;
+    return classes;
+}();
+
+// perfect hash of the keywords, checked below: no two share a slot
+constexpr size_t keyword_slot(std::string_view word) {
+    return (word.size() * 3 + static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back()) * 7) &
+           63;
+}
+
+// the keyword's token_id in its slot, tk_count in empty slots
+constexpr std::array<token_id, 64> keyword_table = []() {
+    std::array<token_id, 64> table{};
+    for (auto& id : table) {
+        id = tk_count;
+    }
+    for (uint8_t id = tk_function; id <= tk_return; id++) {
+        table[keyword_slot(spelling(static_cast<token_id>(id)))] = static_cast<token_id>(id);
+    }
+    return table;
+}();
+
+constexpr bool keyword_slots_distinct() {
+    for (uint8_t i = tk_function; i <= tk_return; i++) {
+        for (uint8_t j = i + 1; j <= tk_return; j++) {
+            if (keyword_slot(spelling(static_cast<token_id>(i))) == keyword_slot(spelling(static_cast<token_id>(j)))) {
+                return false;
             }
-            c = _file.get();
         }
-        // if no space is eaten, return the original location
-        if (!flag) {
-            _file.seekg(_loc.offset);
-        }
-        return next_loc;
     }
-    token_yield eat_number() {
-        auto ident = std::string{};
-        auto next_loc = _loc;
-        auto c = _file.get();
-        if (c == '-') {
-            ident += c;
-            c = _file.get();
-            next_loc = next_loc.step(false);
-        }
-        if (c == '+') {
-            c = _file.get();
-            next_loc = next_loc.step(false);
-        }
-        while (std::isdigit(static_cast<unsigned char>(c))) {
-            ident += c;
-            next_loc = next_loc.step(false);
-            c = _file.get();
-        }
-        if (!ident.empty()) {
-            return std::make_tuple(token_t{token_kind::t_number, ident, _loc}, next_loc);
-        }
-        _file.seekg(_loc.offset);
+    return true;
+}
+static_assert(keyword_slots_distinct(), "keyword_slot must not map two keywords to one slot");
 
-        return std::nullopt;
+/**
+ * splits a source into tokens in one pass: the class of the first character
+ * decides what the token is, keywords are identifiers found in a perfect hash
+ * table, and runs of whitespace, identifier characters and digits are scanned
+ * 16 bytes at a time where SSE2 is available. the tokens go straight into a
+ * token_stream, identifiers and numbers as slices of the buffer, see source.
+ *
+ * numbers take a leading '-' and drop a leading '+', so "n-1" is the
+ * identifier n and the number -1, and a lone '-' is a number too.
+ */
+class lexer {
+private:
+    std::string_view _text;
+    // where the next token is looked for
+    size_t _pos{0};
+
+    uint8_t class_at(size_t pos) const {
+        return pos < _text.size() ? char_classes[static_cast<unsigned char>(_text[pos])] : cc_other;
     }
-    token_yield eat_identifier() {
-        // auto ident = std::string{};
-        std::string ident;
-        auto next_loc = _loc;
-        auto c = _file.get();
-        while (std::isalnum(c) || c == '_') {
-            ident += c;
-            next_loc = next_loc.step(false);
-            c = _file.get();
-        }
-        if (ident.empty()) {
-            std::cout << "[error] empty ident" << std::endl;
-            _file.seekg(_loc.offset);
-            return std::nullopt;
-        }
-        if (std::isdigit(static_cast<unsigned char>(ident[0]))) {
-            std::cout << "[error] ident starts with digit " << ident[0] << std::endl;
-            _file.seekg(_loc.offset);
-            return std::nullopt;
+    bool at(size_t pos, char c) const { return pos < _text.size() && _text[pos] == c; }
+
+    // tk_count if the word is no keyword
+    static token_id keyword_id(std::string_view word) {
+        if (word.size() < 2 || word.size() > 8) {
+            return tk_count;
         }
+        auto id = keyword_table[keyword_slot(word)];
+        return id != tk_count && spelling(id) == word ? id : tk_count;
+    }
 
-        return std::make_tuple(token_t{token_kind::t_identifier, ident, _loc}, next_loc);
+#ifdef VMLUA_LEXER_SSE2
+    // lanes holding a byte in [lo, hi]; bytes >= 0x80 compare negative and never match
+    static __m128i in_range(__m128i v, char lo, char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+    }
+    static __m128i space_lanes(__m128i v) {
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range(v, '\t', '\r'));
     }
+    static __m128i digit_lanes(__m128i v) { return in_range(v, '0', '9'); }
+    static __m128i ident_lanes(__m128i v) {
+        auto letters = _mm_or_si128(in_range(v, 'a', 'z'), in_range(v, 'A', 'Z'));
+        auto rest = _mm_or_si128(digit_lanes(v), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        return _mm_or_si128(letters, rest);
+    }
+#endif
 
-    token_yield eat_keyword() {
-        static const std::vector<std::string> keywords = {
-            "function", "end",  "if",    "elseif", "else", "while", "do",    "in",   "nil",   "repeat",
-            "util",     "true", "false", "and",    "or",   "not",   "break", "then", "local", "return"};
+    enum run_kind { run_space, run_digit, run_ident };
 
-        for (auto const &keyword : keywords) {
-            _file.seekg(_loc.offset);
-            auto next_loc = _loc;
-            auto c = _file.get();
-            auto miss = false;
-            for (auto const &char_ : keyword) {
-                if (c != char_) {
-                    miss = true;
-                    break;
-                }
-                // is this ok?
-                next_loc = std::move(next_loc.step(false));
-                c = _file.get();
-            }
-            // note partial match is not allowed
-            if (!miss && next_loc.offset - _loc.offset == keyword.size()) {
-                return std::make_tuple(token_t{token_kind::t_keyword, keyword, _loc}, next_loc);
-            }
-        }
-        return std::nullopt;
+    static bool continues(run_kind kind, uint8_t cc) {
+        return kind == run_space ? cc == cc_space : cc == cc_digit || (kind == run_ident && cc == cc_alpha);
     }
 
-    token_yield eat_syntax() {
-        static const std::vector<char> syntax = {';', '=', '(', ')', ','};
-        for (auto const &char_ : syntax) {
-            auto next_loc = _loc;
-            auto c = _file.get();
-            next_loc = std::move(next_loc.step(false));
-            if (c == char_) {
-                if (c == '=' && _file.get() == '=') {
-                    return std::nullopt;
-                }
-                return std::make_tuple(token_t{token_kind::t_syntax, std::string{char_}, _loc}, next_loc);
+    // the end of the run of characters of the kind starting at pos
+    template <run_kind kind>
+    size_t scan_run(size_t pos) const {
+#ifdef VMLUA_LEXER_SSE2
+        while (pos + 16 <= _text.size()) {
+            auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(_text.data() + pos));
+            auto lanes = kind == run_space ? space_lanes(v) : kind == run_digit ? digit_lanes(v) : ident_lanes(v);
+            auto matched = static_cast<unsigned>(_mm_movemask_epi8(lanes));
+            if (matched != 0xffff) {
+                return pos + __builtin_ctz(~matched);
             }
-            _file.seekg(_loc.offset);
+            pos += 16;
+        }
+#endif
+        while (pos < _text.size() && continues(kind, class_at(pos))) {
+            pos++;
         }
-        return std::nullopt;
+        return pos;
     }
 
-    token_yield eat_operator() {
-        static const std::vector<std::string> operators = {
-            "and ", "or ", "not ", "==", "!=", ">=", "<=", "+", "-", "*", "/", "^", "%", ">", "<",  //
-        };
-
-        for (auto const &op : operators) {
-            auto next_loc = _loc;
-            auto c = _file.get();
-            auto miss = false;
-            for (auto const &char_ : op) {
-                if (c != char_) {
-                    miss = true;
-                    break;
-                }
-                // is this ok?
-                next_loc = std::move(next_loc.step(false));
-                c = _file.get();
-            }
-            // note partial match is not allowed
-            if (!miss && next_loc.offset - _loc.offset == op.size()) {
-                return std::make_tuple(token_t{token_kind::t_operator, op, _loc}, next_loc);
+    // skips whitespace from _pos, noting where lines start
+    void skip_whitespace(token_stream &tokens) {
+        auto end = scan_run<run_space>(_pos);
+        for (auto pos = _pos; pos < end; pos++) {
+            pos = _text.find('\n', pos);
+            if (pos >= end) {
+                break;
             }
-            // if miss or parital match
-            _file.seekg(_loc.offset);
+            tokens.new_line(pos + 1);
         }
-        return std::nullopt;
+        _pos = end;
     }
 
-    std::vector<std::function<token_yield()>> sub_lexers;
-
-    void load_lexers() {
-        if (!sub_lexers.empty()) {
-            // std::cout << "[debug] skip load lexer" << sub_lexers.size() << std::endl;
-            return;
-        }
-        // std::cout << "[debug] load lexers" << std::endl;
-        sub_lexers.reserve(5);
-        sub_lexers.push_back([this]() {
-            std::cout << "[debug] call eat_keyword" << std::endl;
-            return eat_keyword();
-        });
-        sub_lexers.push_back([this]() {
-            std::cout << "[debug] call eat_identifier" << std::endl;
-            return eat_identifier();
-        });
-        sub_lexers.push_back([this]() {
-            std::cout << "[debug] call eat_number" << std::endl;
-            return eat_number();
-        });
-        sub_lexers.push_back([this]() {
-            std::cout << "[debug] call eat_syntax" << std::endl;
-            return eat_syntax();
-        });
-        sub_lexers.push_back([this]() {
-            std::cout << "[debug] call eat_operator" << std::endl;
-            return eat_operator();
-        });
+    [[noreturn]] void unexpected(token_stream const &tokens, size_t pos) const {
+        auto loc = tokens.locate(pos);
+        throw std::runtime_error("unexpected character: " + std::string{_text[pos]} + " at " +
+                                 std::to_string(loc.line) + ":" + std::to_string(loc.column));
     }
 
-public:
-    struct iterator {
-        using iterator_category = std::forward_iterator_tag;
-        using difference_type = std::ptrdiff_t;
-        using value_type = std::unique_ptr<token_yield>;
-        using pointer = value_type *;
-        using reference = value_type const &;
-        size_t _file_off;
-        lexer &_parent;
-        value_type _token_yield;
-        iterator(lexer &parent, const size_t file_off) : _parent(parent), _file_off(file_off) { load_token(); }
-        iterator(const iterator &other) : _parent(other._parent), _file_off(other._file_off) { load_token(); }
-        void load_token() {
-            if (_file_off == EOF) {
-                _token_yield = std::make_unique<token_yield>(
-                    std::optional(std::tuple(token_t{token_kind::t_eof, "", _parent._loc}, _parent._loc)));
-                return;
-            }
-            _parent._file.seekg(_file_off);
-            _token_yield = std::make_unique<token_yield>(_parent.next());
+    // appends the next token, false at the end of the source
+    bool next(token_stream &tokens) {
+        skip_whitespace(tokens);
+        auto pos = _pos;
+        if (pos >= _text.size()) {
+            return false;
         }
-        reference operator*() const { return _token_yield; }
-        pointer operator->() { return &_token_yield; }
-        // ++it
-        iterator &operator++() {
-            if (_file_off == EOF) {
-                _token_yield = std::make_unique<token_yield>(
-                    std::optional(std::tuple(token_t{token_kind::t_eof, "", _parent._loc}, _parent._loc)));
-                return *this;
+        auto end = pos + 1;
+        auto id = tk_count;
+        switch (class_at(pos)) {
+            case cc_alpha: {
+                end = scan_run<run_ident>(end);
+                auto word = _text.substr(pos, end - pos);
+                id = keyword_id(word);
+                if (id == tk_count) {
+                    tokens.push(t_identifier, word, pos);
+                }
+                break;
             }
-            _parent._file.seekg(_file_off);
-            _token_yield = std::make_unique<token_yield>(_parent.next());
-            if (_token_yield.get()->has_value()) {
-                auto &t = _token_yield.get()->value();
-                _file_off = std::get<1>(t).offset;
-                _parent._loc = std::get<1>(t);
-            } else {
-                _file_off = EOF;
+            case cc_digit:
+                end = scan_run<run_digit>(end);
+                tokens.push(t_number, _text.substr(pos, end - pos), pos);
+                break;
+            case cc_minus: {
+                auto plus = at(end, '+');
+                auto digits = end + plus;
+                end = scan_run<run_digit>(digits);
+                // the plus sign is dropped, "-+1" is the one literal that is not a slice
+                tokens.push(t_number,
+                            plus ? intern_text(lb::string_util::concat("-", _text.substr(digits, end - digits)))
+                                 : _text.substr(pos, end - pos),
+                            pos);
+                break;
+            }
+            case cc_plus:
+                if (class_at(end) == cc_digit) {
+                    auto digits = end;
+                    end = scan_run<run_digit>(digits);
+                    tokens.push(t_number, _text.substr(digits, end - digits), pos);
+                } else {
+                    id = tk_plus;
+                }
+                break;
+            case cc_syntax:
+                id = _text[pos] == ';' ? tk_semicolon : _text[pos] == '(' ? tk_lparen : _text[pos] == ')' ? tk_rparen
+                                                                                                        : tk_comma;
+                break;
+            case cc_equal:
+                id = at(end, '=') ? tk_eq : tk_assign;
+                end += id == tk_eq;
+                break;
+            case cc_compare: {
+                auto equal = at(end, '=');
+                id = _text[pos] == '<' ? (equal ? tk_le : tk_lt) : (equal ? tk_ge : tk_gt);
+                end += equal;
+                break;
             }
-            return *this;
+            case cc_bang:
+                if (!at(end, '=')) {
+                    unexpected(tokens, pos);
+                }
+                id = tk_ne;
+                end++;
+                break;
+            case cc_arith:
+                id = _text[pos] == '*' ? tk_star : _text[pos] == '/' ? tk_slash : _text[pos] == '^' ? tk_caret
+                                                                                                    : tk_percent;
+                break;
+            default:
+                unexpected(tokens, pos);
         }
-
-        // it++
-        iterator operator++(int) {
-            iterator tmp = *this;
-            ++(*this);
-            return tmp;
+        if (id != tk_count) {
+            tokens.push(id, pos);
         }
-        friend bool operator==(const iterator &a, const iterator &b) { return a._file_off == b._file_off; };
-        friend bool operator!=(const iterator &a, const iterator &b) { return a._file_off != b._file_off; };
-    };
-
-    explicit lexer(std::ifstream &file) : _file(file), _loc(location{}) {}
-
-    iterator begin() { return iterator(*this, 0); }
-    iterator end() { return iterator(*this, EOF); }
-
-    void reset() {
-        _file.seekg(0);
-        _loc = location{};
+        _pos = end;
+        return true;
     }
-    token_yield next() {
-        _file.seekg(_loc.offset);
-        std::cout << "[debug] current file offset: " << _file.tellg() << std::endl;
-        load_lexers();
-        if (_file.peek() == EOF) {
-            return std::nullopt;
-        }
-        _loc = eat_whitespace();
 
-        std::cout << "[debug] get space. current file offset: " << _file.tellg() << std::endl;
+public:
+    explicit lexer(std::string_view text) : _text(text) {}
+    explicit lexer(source const &src) : lexer(src.text()) {}
 
-        if (_file.peek() == EOF) {
-            return std::nullopt;
+    token_stream tokenize() {
+        if (_text.size() > UINT32_MAX) {
+            throw std::runtime_error("source too large: " + std::to_string(_text.size()) + " bytes");
         }
-        for (auto &sub_lexer : sub_lexers) {
-            if (nullptr == sub_lexer) {
-                std::cerr << "[error] sub_lexer is nullptr" << std::endl;
-                exit(1);
-            }
-            auto lex = sub_lexer();
-            if (lex) {
-                _loc = std::get<1>(lex.value());
-                _file.seekg(_loc.offset);
-                std::cout << "[debug] get token. current file offset: " << _file.tellg() << std::endl;
-                std::cout << "[debug] lex: " << std::get<0>(lex.value()).to_string() << std::endl;
-                return lex.value();
-            }
-            _file.seekg(_loc.offset);
-            std::cout << "[debug] no token. current file offset: " << _file.tellg() << std::endl;
-        }
-        if (_file.peek() == EOF) {
-            return std::nullopt;
-        } else {
-            throw std::runtime_error("unexpected character: " + std::string{static_cast<char>(_file.get())} + " at " +
-                                     std::to_string(_loc.line) + ":" + std::to_string(_loc.column));
+        token_stream tokens;
+        // about one token per four bytes of typical source
+        tokens.reserve(_text.size() / 4);
+        while (next(tokens)) {
         }
+        tokens.finish(_text.size());
+        VMLUA_TRACE(tc_lexer, tl_debug, "tokens:" << vmlua::to_string(tokens));
+        return tokens;
     }
+
+    void reset() { _pos = 0; }
 };
 
 }  // namespace lb::vmlua
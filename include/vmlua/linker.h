@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+
+#include "vm.h"
+namespace lb::vmlua {
+
+/**
+ * resolves label operands to instruction offsets, so that the vm never
+ * looks up program::syms while running
+ */
+class linker {
+public:
+    void link(program& prog) {
+        if (prog.linked) {
+            return;
+        }
+        for (auto& inst : prog.insts) {
+            switch (inst.op) {
+                case op_jnz:
+                case op_jz:
+                case op_jmp:
+                    inst.a = resolve(prog, prog.labels[inst.a]).loc;
+                    break;
+                case op_call:
+                case op_tailcall: {
+                    auto& label = prog.labels[inst.a];
+                    auto& sym = resolve(prog, label);
+                    // the callee's frame starts at its first argument, with fewer
+                    // it would reach into the caller's. the emitter drops surplus ones
+                    if (inst.c != sym.nargs) {
+                        throw std::runtime_error(lb::string_util::concat("function ", label, " takes ", sym.nargs,
+                                                                         " arguments, called with ", inst.c));
+                    }
+                    if (sym.nargs > UINT8_MAX || sym.nlocals > UINT16_MAX) {
+                        throw std::runtime_error("too many locals in function " + label);
+                    }
+                    inst.a = sym.loc;
+                    inst.b = static_cast<uint8_t>(sym.nargs);
+                    inst.c = static_cast<uint16_t>(sym.nlocals);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        prog.linked = true;
+    }
+
+private:
+    symbol const& resolve(program& prog, std::string const& label) {
+        auto it = prog.syms.find(label);
+        if (it == prog.syms.end()) {
+            throw std::runtime_error("undefined symbol: " + label);
+        }
+        return it->second;
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,77 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace lb::vmlua {
+
+/**
+ * bounded result cache of a pure function, keyed by its argument tuple.
+ * direct mapped: each key has a single entry and a colliding key overwrites
+ * it, so a lookup touches one cache line and the table never grows.
+ */
+class memo_table {
+public:
+    static constexpr size_t max_args = 4;
+    static constexpr size_t default_capacity = 1 << 16;
+
+private:
+    // padded to 32 bytes and aligned, so that no entry straddles two lines
+    struct alignas(32) entry {
+        int32_t args[max_args];
+        int32_t value;
+        uint32_t used;
+    };
+    static_assert(sizeof(entry) == 32, "an entry must fit half a cache line");
+    std::vector<entry> _entries;
+    size_t _nargs;
+    size_t _mask;
+
+public:
+    // capacity is rounded up to a power of two
+    memo_table(size_t nargs, size_t capacity = default_capacity) : _nargs(nargs) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _entries.assign(size, entry{});
+        _mask = size - 1;
+    }
+
+    static bool fits(size_t nargs) { return nargs <= max_args; }
+
+    bool lookup(int32_t const* args, int32_t& value) const {
+        auto& e = _entries[slot(args)];
+        if (!e.used || !same_args(e, args)) {
+            return false;
+        }
+        value = e.value;
+        return true;
+    }
+
+    void insert(int32_t const* args, int32_t value) {
+        auto& e = _entries[slot(args)];
+        std::copy(args, args + _nargs, e.args);
+        e.value = value;
+        e.used = 1;
+    }
+
+private:
+    size_t slot(int32_t const* args) const {
+        uint64_t h = 0x9E3779B97F4A7C15ull;
+        for (size_t i = 0; i < _nargs; i++) {
+            h = (h ^ static_cast<uint32_t>(args[i])) * 0xBF58476D1CE4E5B9ull;
+            h ^= h >> 31;
+        }
+        return static_cast<size_t>(h) & _mask;
+    }
+    bool same_args(entry const& e, int32_t const* args) const {
+        for (size_t i = 0; i < _nargs; i++) {
+            if (e.args[i] != args[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lb/util.h"
+
+namespace lb::vmlua {
+
+/**
+ * host functions callable from scripts. each one gets an integer id when it
+ * is registered; the emitters resolve calls by name to that id at compile
+ * time and the engines call natives[id] directly, so no name is looked up
+ * while running.
+ *
+ * a native receives its arguments in call order, left to right. print is
+ * built into the engines and cannot be registered.
+ */
+class native_registry {
+public:
+    static constexpr size_t variadic = SIZE_MAX;
+
+    using function = std::function<int32_t(int32_t const* args, size_t argc)>;
+
+    struct native {
+        std::string name;
+        // number of arguments taken, variadic for any
+        size_t arity;
+        function fn;
+    };
+
+private:
+    std::vector<native> _natives;
+    std::map<std::string, int32_t> _ids;
+
+public:
+    // returns the id calls to name compile to
+    int32_t add(std::string const& name, size_t arity, function fn) {
+        if (name == "print") {
+            throw std::runtime_error("print is builtin and cannot be registered");
+        }
+        if (_ids.find(name) != _ids.end()) {
+            throw std::runtime_error("native function already registered: " + name);
+        }
+        auto id = static_cast<int32_t>(_natives.size());
+        _natives.push_back(native{name, arity, std::move(fn)});
+        _ids.insert({name, id});
+        return id;
+    }
+
+    // -1 if name is not a native
+    int32_t find(std::string const& name) const {
+        auto it = _ids.find(name);
+        return it == _ids.end() ? -1 : it->second;
+    }
+
+    // checks a call to id with argc arguments, at compile time
+    void check_call(int32_t id, size_t argc) const {
+        auto& n = _natives[id];
+        if (n.arity != variadic && n.arity != argc) {
+            throw std::runtime_error(lb::string_util::concat("native function ", n.name, " takes ", n.arity,
+                                                             " arguments, called with ", argc));
+        }
+    }
+
+    // checks a script function declared as name, at compile time. calls
+    // resolve to natives first, so the declaration could never be called
+    void check_declaration(std::string const& name) const {
+        if (find(name) >= 0) {
+            throw std::runtime_error("cannot declare function " + name + ", a native function has that name");
+        }
+    }
+
+    native const& operator[](int32_t id) const { return _natives[id]; }
+    size_t size() const { return _natives.size(); }
+};
+}  // namespace lb::vmlua
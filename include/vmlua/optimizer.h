@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "types.h"
+namespace lb::vmlua {
+
+/**
+ * ast pass run between parser::parse and code generation:
+ *
+ *  - binary_op nodes with two number operands are folded
+ *  - locals bound to a number are propagated into later uses in their scope,
+ *    and the binding is dropped once nothing reads it anymore, unless the
+ *    function reads a name before declaring it. as in the emitters a name
+ *    reads its first declaration in the function, so a name declared again
+ *    is no longer propagated
+ *  - if_stmt nodes with a constant condition are replaced by the taken branch,
+ *    the locals of the other one bound to 0
+ *
+ * folding follows the vm semantics: 32-bit wrapping arithmetic, comparisons
+ * yielding 0 or 1, and/or on the bit patterns.
+ */
+class const_folder {
+public:
+    struct stats {
+        size_t folded{0};
+        size_t propagated{0};
+        size_t pruned{0};
+    };
+
+    stats optimize(ast& ast) {
+        _stats = stats{};
+        _ast = &ast;
+        std::map<std::string, int32_t> consts;
+        std::set<std::string> declared;
+        fold_block(ast.stmts(), consts, declared);
+        drop_unused_locals(ast.stmts());
+        _ast = nullptr;
+        return _stats;
+    }
+
+private:
+    using stmts = stmt_list;
+    stats _stats;
+    // where the folded numbers are made
+    ast* _ast{nullptr};
+
+    static bool evaluate(const std::string& op, int32_t l, int32_t r, int32_t& out) {
+        auto ul = static_cast<uint32_t>(l), ur = static_cast<uint32_t>(r);
+        if (op == "+") {
+            out = static_cast<int32_t>(ul + ur);
+        } else if (op == "-") {
+            out = static_cast<int32_t>(ul - ur);
+        } else if (op == "<") {
+            out = l < r;
+        } else if (op == ">") {
+            out = l > r;
+        } else if (op == "<=") {
+            out = l <= r;
+        } else if (op == ">=") {
+            out = l >= r;
+        } else if (op == "==") {
+            out = l == r;
+        } else if (op == "!=") {
+            out = l != r;
+        } else if (op == "&&" || op == "and") {
+            out = l & r;
+        } else if (op == "||" || op == "or") {
+            out = l | r;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static literal_number* as_number(expr_t* e) { return node_cast<literal_number>(e); }
+
+    void fold_expr(expr_t*& e, std::map<std::string, int32_t> const& consts) {
+        visit(e, overloaded{
+                     [&](literal_id* p) {
+                         auto it = consts.find(to_string(p->token));
+                         if (it != consts.end()) {
+                             e = _ast->make<literal_number>(
+                                 token_t{t_number, intern_text(std::to_string(it->second)), p->token.loc});
+                             _stats.propagated++;
+                         }
+                     },
+                     [&](func_call* p) {
+                         for (auto& arg : p->arguments) {
+                             fold_expr(arg, consts);
+                         }
+                     },
+                     [&](binary_op* p) {
+                         fold_expr(p->left, consts);
+                         fold_expr(p->right, consts);
+                         auto* l = as_number(p->left);
+                         auto* r = as_number(p->right);
+                         int32_t value;
+                         if (l != nullptr && r != nullptr &&
+                             evaluate(to_string(p->op), std::stoi(to_string(l->token)),
+                                      std::stoi(to_string(r->token)), value)) {
+                             e = _ast->make<literal_number>(
+                                 token_t{t_number, intern_text(std::to_string(value)), p->op.loc});
+                             _stats.folded++;
+                         }
+                     },
+                     [](literal_number*) {},
+                 });
+    }
+
+    // consts holds the constant locals visible in this block, branches work
+    // on a copy as their locals are not visible after them. declared holds
+    // every name declared in the function so far, branches included
+    void fold_block(stmts& block, std::map<std::string, int32_t>& consts, std::set<std::string>& declared) {
+        for (size_t i = 0; i < block.size(); i++) {
+            visit(block[i], overloaded{
+                                [&](local_stmt* p) {
+                                    fold_expr(p->expr, consts);
+                                    // a redeclaration writes a slot of its own, which nothing reads
+                                    if (!declared.insert(to_string(p->name)).second) {
+                                        consts.erase(to_string(p->name));
+                                    } else if (auto* n = as_number(p->expr)) {
+                                        consts[to_string(p->name)] = std::stoi(to_string(n->token));
+                                    } else {
+                                        consts.erase(to_string(p->name));
+                                    }
+                                },
+                                [&](ret_stmt* p) { fold_expr(p->expr, consts); },
+                                [&](expr_stmt* p) { fold_expr(p->expr, consts); },
+                                [&](func_decl* p) {
+                                    std::map<std::string, int32_t> scope;
+                                    std::set<std::string> params;
+                                    for (auto&& param : p->params) {
+                                        params.insert(to_string(param));
+                                    }
+                                    auto names = params;
+                                    fold_block(p->body, scope, names);
+                                    drop_unused_locals(p->body, params);
+                                },
+                                [&](if_stmt* p) {
+                                    fold_expr(p->condition, consts);
+                                    auto* cond = as_number(p->condition);
+                                    if (cond == nullptr) {
+                                        auto then_consts = consts, else_consts = consts;
+                                        fold_block(p->then_body, then_consts, declared);
+                                        fold_block(p->else_body, else_consts, declared);
+                                        return;
+                                    }
+                                    // the taken branch replaces the if. the locals of the other
+                                    // one still take their slots and read 0, as they are never
+                                    // written
+                                    auto taken = std::stoi(to_string(cond->token)) != 0;
+                                    stmts branch;
+                                    if (!taken) {
+                                        declare_zeros(p->then_body, branch);
+                                    }
+                                    auto& live = taken ? p->then_body : p->else_body;
+                                    branch.insert(branch.end(), live.begin(), live.end());
+                                    if (taken) {
+                                        declare_zeros(p->else_body, branch);
+                                    }
+                                    auto branch_consts = consts;
+                                    fold_block(branch, branch_consts, declared);
+                                    block.erase(block.begin() + i);
+                                    block.insert(block.begin() + i, branch.begin(), branch.end());
+                                    i += branch.size();
+                                    i--;
+                                    _stats.pruned++;
+                                },
+                            });
+        }
+    }
+
+    // appends a local bound to 0 for every local declared in block
+    void declare_zeros(stmts const& block, stmts& out) {
+        for (auto& stmt : block) {
+            if (auto* p = node_cast<local_stmt>(stmt)) {
+                auto zero = _ast->make<literal_number>(token_t{t_number, intern_text("0"), p->name.loc});
+                out.push_back(_ast->make<local_stmt>(p->name, zero));
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                declare_zeros(p->then_body, out);
+                declare_zeros(p->else_body, out);
+            }
+        }
+    }
+
+    static void collect_names(expr_t* e, std::set<std::string>& names) {
+        visit(e, overloaded{
+                     [&](literal_id* p) { names.insert(to_string(p->token)); },
+                     [&](func_call* p) {
+                         for (auto& arg : p->arguments) {
+                             collect_names(arg, names);
+                         }
+                     },
+                     [&](binary_op* p) {
+                         collect_names(p->left, names);
+                         collect_names(p->right, names);
+                     },
+                     [](literal_number*) {},
+                 });
+    }
+
+    // names read in a function body, not looking into nested functions
+    static void collect_names(stmts const& block, std::set<std::string>& names) {
+        for (auto& stmt : block) {
+            visit(stmt, overloaded{
+                            [&](local_stmt* p) { collect_names(p->expr, names); },
+                            [&](ret_stmt* p) { collect_names(p->expr, names); },
+                            [&](expr_stmt* p) { collect_names(p->expr, names); },
+                            [&](if_stmt* p) {
+                                collect_names(p->condition, names);
+                                collect_names(p->then_body, names);
+                                collect_names(p->else_body, names);
+                            },
+                            [](func_decl*) {},
+                        });
+        }
+    }
+
+    // whether block reads a name before any declaration of it, which reads
+    // slot 0 and so depends on which local holds it. declared holds the
+    // names declared so far, in the order the emitters compile them
+    static bool reads_undeclared(expr_t* e, std::set<std::string> const& declared) {
+        std::set<std::string> names;
+        collect_names(e, names);
+        return std::any_of(names.begin(), names.end(), [&](auto const& n) { return declared.count(n) == 0; });
+    }
+    static bool reads_undeclared(stmts const& block, std::set<std::string>& declared) {
+        for (auto& stmt : block) {
+            auto undeclared = visit(stmt, overloaded{
+                                              [&](local_stmt* p) {
+                                                  declared.insert(to_string(p->name));
+                                                  return reads_undeclared(p->expr, declared);
+                                              },
+                                              [&](ret_stmt* p) { return reads_undeclared(p->expr, declared); },
+                                              [&](expr_stmt* p) { return reads_undeclared(p->expr, declared); },
+                                              [&](if_stmt* p) {
+                                                  return reads_undeclared(p->condition, declared) ||
+                                                         reads_undeclared(p->then_body, declared) ||
+                                                         reads_undeclared(p->else_body, declared);
+                                              },
+                                              [](func_decl*) { return false; },
+                                          });
+            if (undeclared) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void drop_constant_locals(stmts& block, std::set<std::string> const& used) {
+        for (size_t i = 0; i < block.size();) {
+            if (auto* p = node_cast<local_stmt>(block[i])) {
+                if (as_number(p->expr) != nullptr && used.count(to_string(p->name)) == 0) {
+                    block.erase(block.begin() + i);
+                    continue;
+                }
+            } else if (auto* p = node_cast<if_stmt>(block[i])) {
+                drop_constant_locals(p->then_body, used);
+                drop_constant_locals(p->else_body, used);
+            }
+            i++;
+        }
+    }
+
+    // dropping a local moves the later ones down a slot, which only a read
+    // of an undeclared name can see
+    void drop_unused_locals(stmts& block, std::set<std::string> declared = {}) {
+        if (reads_undeclared(block, declared)) {
+            return;
+        }
+        std::set<std::string> used;
+        collect_names(block, used);
+        drop_constant_locals(block, used);
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,184 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define VMLUA_OUTPUT_ISATTY 1
+#endif
+
+namespace lb::vmlua {
+
+/**
+ * buffered sink for the values scripts print. values are formatted straight
+ * into a buffer of capacity bytes, without iostreams, and the buffer is
+ * written to the file when it fills up, when it is flushed (at the latest
+ * when the sink is destroyed) and, with flush_line, after every line.
+ *
+ * in threaded mode a writer thread writes full buffers while the script
+ * fills the other one. the sink itself is not thread safe: one engine writes
+ * to it at a time.
+ */
+class output {
+public:
+    static constexpr size_t default_capacity = 1 << 16;
+
+    enum flush_policy : uint8_t {
+        flush_full,  // when the buffer is full or flushed
+        flush_line,  // after every line as well
+    };
+
+private:
+    std::FILE* _file;
+    flush_policy _policy;
+    std::vector<char> _front;
+    size_t _used{0};
+    // threaded mode: the buffer the writer thread is writing, _pending bytes of it
+    std::vector<char> _back;
+    size_t _pending{0};
+    bool _stop{false};
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _writer;
+
+public:
+    explicit output(std::FILE* file = stdout, size_t capacity = default_capacity,
+                    flush_policy policy = default_policy(stdout), bool threaded = false)
+        : _file(file), _policy(policy), _front(std::max<size_t>(capacity, max_int_chars)) {
+        if (threaded) {
+            _back.resize(_front.size());
+            _writer = std::thread([this]() { write_behind(); });
+        }
+    }
+    ~output() {
+        flush();
+        if (_writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _cv.notify_all();
+            _writer.join();
+        }
+    }
+    output(const output&) = delete;
+    output& operator=(const output&) = delete;
+
+    // line buffered on terminals, so interactive output shows up at once
+    static flush_policy default_policy(std::FILE* file) {
+#ifdef VMLUA_OUTPUT_ISATTY
+        return isatty(fileno(file)) ? flush_line : flush_full;
+#else
+        return flush_full;
+#endif
+    }
+
+    // stdout with the default policy, flushed at exit
+    static output& standard() {
+        static output out;
+        return out;
+    }
+
+    void put(char c) {
+        if (_used == _front.size()) {
+            drain();
+        }
+        _front[_used++] = c;
+    }
+
+    void write(int32_t v) {
+        if (_front.size() - _used < max_int_chars) {
+            drain();
+        }
+        char digits[max_int_chars];
+        auto* end = digits + max_int_chars;
+        auto* p = end;
+        // negated as unsigned, INT32_MIN has no positive int32_t
+        auto u = v < 0 ? 0u - static_cast<uint32_t>(v) : static_cast<uint32_t>(v);
+        do {
+            *--p = static_cast<char>('0' + u % 10);
+            u /= 10;
+        } while (u != 0);
+        if (v < 0) {
+            *--p = '-';
+        }
+        std::copy(p, end, _front.data() + _used);
+        _used += end - p;
+    }
+
+    void write(std::string_view text) {
+        while (!text.empty()) {
+            if (_used == _front.size()) {
+                drain();
+            }
+            auto n = std::min(text.size(), _front.size() - _used);
+            std::copy(text.begin(), text.begin() + n, _front.data() + _used);
+            _used += n;
+            text.remove_prefix(n);
+        }
+    }
+
+    void end_line() {
+        put('\n');
+        if (_policy == flush_line) {
+            flush();
+        }
+    }
+
+    // writes everything buffered through to the file
+    void flush() {
+        drain();
+        if (_writer.joinable()) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return _pending == 0; });
+        }
+        std::fflush(_file);
+    }
+
+private:
+    // "-2147483648"
+    static constexpr size_t max_int_chars = 11;
+
+    // hands the buffer to the file, or to the writer thread once it is idle
+    void drain() {
+        if (_used == 0) {
+            return;
+        }
+        if (!_writer.joinable()) {
+            std::fwrite(_front.data(), 1, _used, _file);
+            _used = 0;
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return _pending == 0; });
+            _front.swap(_back);
+            _pending = _used;
+        }
+        _cv.notify_all();
+        _used = 0;
+    }
+
+    void write_behind() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [this]() { return _pending > 0 || _stop; });
+            if (_pending == 0) {
+                return;
+            }
+            // _back is not touched by the script until _pending is reset
+            auto size = _pending;
+            lock.unlock();
+            std::fwrite(_back.data(), 1, size, _file);
+            lock.lock();
+            _pending = 0;
+            _cv.notify_all();
+        }
+    }
+};
+}  // namespace lb::vmlua
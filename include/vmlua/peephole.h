@@ -0,0 +1,235 @@
+#pragma once
+#include <algorithm>
+
+#include "vm.h"
+namespace lb::vmlua {
+
+/**
+ * local clean-ups on a linked program, run before superinstruction fusion:
+ *
+ *  - jumps to jumps are threaded to the final target
+ *  - jumps to the next instruction are removed (conditional ones become POP)
+ *  - PUSH x; POP and PUSH FP + k; POP FP + k pairs are removed
+ *  - code unreachable from the entry or any call target is removed
+ *  - function bodies are moved in front of the top level code, which turns
+ *    the jumps around them into jumps to the next instruction
+ */
+class peephole {
+public:
+    // returns the number of instructions eliminated
+    size_t optimize(program& prog) {
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before peephole optimization");
+        }
+        auto before = prog.insts.size();
+        auto laid_out = false;
+        while (true) {
+            thread_jumps(prog);
+            if (simplify(prog) || remove_unreachable(prog)) {
+                continue;
+            }
+            if (laid_out) {
+                break;
+            }
+            layout(prog);
+            laid_out = true;
+        }
+        return before - prog.insts.size();
+    }
+
+private:
+    static bool is_return(opcode op) {
+        return op == op_ret || op == op_retval || op == op_ret_fp || op == op_ret_k || op == op_ret_add_fp_fp ||
+               op == op_tailcall;
+    }
+    static bool is_call(opcode op) { return op == op_call || op == op_tailcall; }
+    static bool falls_through(opcode op) { return op != op_jmp && !is_return(op); }
+    static bool is_jump(opcode op) { return program::has_target(op) && !is_call(op); }
+
+    static std::vector<bool> find_targets(program const& prog) {
+        std::vector<bool> targets(prog.insts.size() + 1, false);
+        for (auto& inst : prog.insts) {
+            if (program::has_target(inst.op)) {
+                targets[inst.a] = true;
+            }
+        }
+        return targets;
+    }
+
+    // keeps the instructions marked in keep, removed ones are remapped to the
+    // next kept instruction
+    static void compact(program& prog, std::vector<bool> const& keep) {
+        std::vector<instruction> code;
+        std::vector<int32_t> remap(prog.insts.size() + 1);
+        for (size_t i = 0; i < prog.insts.size(); i++) {
+            remap[i] = static_cast<int32_t>(code.size());
+            if (keep[i]) {
+                code.push_back(prog.insts[i]);
+            }
+        }
+        remap[prog.insts.size()] = static_cast<int32_t>(code.size());
+        prog.relocate(std::move(code), remap);
+    }
+
+    void thread_jumps(program& prog) {
+        auto size = static_cast<int32_t>(prog.insts.size());
+        // where a chain of jmps starting at each offset ends, so that every
+        // jmp is followed once however many jumps share its chain
+        constexpr int32_t unresolved = -1, on_path = -2;
+        std::vector<int32_t> final(prog.insts.size(), unresolved);
+        std::vector<int32_t> path;
+        for (auto& inst : prog.insts) {
+            if (!is_jump(inst.op)) {
+                continue;
+            }
+            auto target = inst.a;
+            while (target < size && prog.insts[target].op == op_jmp && final[target] == unresolved) {
+                final[target] = on_path;
+                path.push_back(target);
+                target = prog.insts[target].a;
+            }
+            // a cycle of jumps ends where it closes
+            if (target < size && final[target] >= 0) {
+                target = final[target];
+            }
+            for (auto pc : path) {
+                final[pc] = target;
+            }
+            path.clear();
+            inst.a = target;
+        }
+    }
+
+    bool simplify(program& prog) {
+        auto& insts = prog.insts;
+        auto targets = find_targets(prog);
+        std::vector<bool> keep(insts.size(), true);
+        auto changed = false;
+        for (size_t i = 0; i < insts.size(); i++) {
+            auto& inst = insts[i];
+            if (is_jump(inst.op) && inst.a == static_cast<int32_t>(i + 1)) {
+                if (inst.op == op_jmp) {
+                    keep[i] = false;
+                    changed = true;
+                } else if (inst.op == op_jz || inst.op == op_jnz) {
+                    inst = instruction{op_pop};
+                    changed = true;
+                }
+                continue;
+            }
+            if (i + 1 >= insts.size() || targets[i + 1]) {
+                continue;
+            }
+            auto& next = insts[i + 1];
+            auto push_pop = (inst.op == op_store || inst.op == op_dup_plus_fp) && next.op == op_pop;
+            auto same_slot = inst.op == op_dup_plus_fp && next.op == op_move_plus_fp && inst.a == next.a;
+            if (push_pop || same_slot) {
+                keep[i] = false;
+                keep[i + 1] = false;
+                changed = true;
+                i++;
+            }
+        }
+        if (changed) {
+            compact(prog, keep);
+        }
+        return changed;
+    }
+
+    // floods from start along jumps and fall through. calls only continue
+    // to the next instruction, their targets (and those of tail calls) are
+    // returned in callees
+    static void flood(program const& prog, int32_t start, std::vector<bool>& reached, std::vector<int32_t>* callees) {
+        std::vector<int32_t> work{start};
+        while (!work.empty()) {
+            auto pc = work.back();
+            work.pop_back();
+            if (pc >= prog.insts.size() || reached[pc]) {
+                continue;
+            }
+            reached[pc] = true;
+            auto& inst = prog.insts[pc];
+            if (is_call(inst.op)) {
+                if (callees != nullptr) {
+                    callees->push_back(inst.a);
+                }
+            } else if (is_jump(inst.op)) {
+                work.push_back(inst.a);
+            }
+            if (falls_through(inst.op)) {
+                work.push_back(pc + 1);
+            }
+        }
+    }
+
+    static std::vector<int32_t> call_targets(program const& prog) {
+        std::vector<int32_t> callees;
+        for (auto& inst : prog.insts) {
+            if (is_call(inst.op)) {
+                callees.push_back(inst.a);
+            }
+        }
+        return callees;
+    }
+
+    bool remove_unreachable(program& prog) {
+        std::vector<bool> reached(prog.insts.size(), false);
+        std::vector<int32_t> callees;
+        flood(prog, prog.entry, reached, &callees);
+        while (!callees.empty()) {
+            auto callee = callees.back();
+            callees.pop_back();
+            if (callee < reached.size() && !reached[callee]) {
+                flood(prog, callee, reached, &callees);
+            }
+        }
+        if (std::all_of(reached.begin(), reached.end(), [](bool r) { return r; })) {
+            return false;
+        }
+        // symbols of dead code are dropped, not moved onto live code
+        for (auto it = prog.syms.begin(); it != prog.syms.end();) {
+            auto loc = it->second.loc;
+            if (loc < reached.size() && !reached[loc]) {
+                it = prog.syms.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        compact(prog, reached);
+        return true;
+    }
+
+    // moves every function body in front of the top level code, keeping the
+    // relative order of both. gives up if some code is shared between them
+    void layout(program& prog) {
+        auto size = prog.insts.size();
+        std::vector<bool> top_level(size, false);
+        flood(prog, prog.entry, top_level, nullptr);
+        std::vector<bool> functions(size, false);
+        for (auto callee : call_targets(prog)) {
+            flood(prog, callee, functions, nullptr);
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (top_level[i] && functions[i]) {
+                return;
+            }
+        }
+        // top level code must end the program, as it stops by running off the end
+        if (size > 0 && !top_level[size - 1] && falls_through(prog.insts[size - 1].op)) {
+            return;
+        }
+        std::vector<instruction> code;
+        std::vector<int32_t> remap(size + 1);
+        for (auto pass : {false, true}) {
+            for (size_t i = 0; i < size; i++) {
+                if (top_level[i] == pass) {
+                    remap[i] = static_cast<int32_t>(code.size());
+                    code.push_back(prog.insts[i]);
+                }
+            }
+        }
+        remap[size] = static_cast<int32_t>(code.size());
+        prog.relocate(std::move(code), remap);
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,258 @@
+#pragma once
+#include <csignal>
+#include <iomanip>
+#include <ostream>
+#include <set>
+
+#include "vm.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define VMLUA_PROFILER_TIMER 1
+#endif
+
+namespace lb::vmlua {
+
+/**
+ * sampling profiler for the stack vm. a sample is taken every interval
+ * instructions, or with by_timer every interval microseconds of cpu time
+ * as counted by a SIGPROF timer. a sample records the pc and the call stack
+ * rebuilt from the vm's frame records: the caller of each frame is the
+ * function holding its return pc.
+ *
+ * every instruction belongs to the function whose code reaches it without
+ * calls, found by walking the control flow from each call target, so code
+ * inlined by the emitter counts for its caller and the top level code is
+ * "main". tail calls replace their caller's frame, which therefore does not
+ * show up in the stack.
+ */
+class profiler : public debug_hook {
+public:
+    enum mode { by_instructions, by_timer };
+    static constexpr uint32_t default_interval = 1000;
+
+private:
+    struct function {
+        std::string name;
+        uint64_t self{0};
+        uint64_t total{0};
+    };
+    mode _mode;
+    uint32_t _interval;
+    uint32_t _countdown;
+    uint64_t _samples{0};
+    std::vector<function> _functions;
+    // function index of every instruction, -1 if none reaches it
+    std::vector<int32_t> _owner;
+    std::vector<uint64_t> _pc_samples;
+    // collapsed stacks, outermost function first
+    std::map<std::string, uint64_t> _stacks;
+
+    static volatile std::sig_atomic_t& timer_fired() {
+        static volatile std::sig_atomic_t fired = 0;
+        return fired;
+    }
+
+public:
+    // the timer is not available on every platform, instructions are counted then
+    profiler(program const& prog, mode m = by_instructions, uint32_t interval = default_interval)
+        : _mode(timer_supported() ? m : by_instructions),
+          _interval(std::max<uint32_t>(interval, 1)),
+          _countdown(_interval),
+          _owner(prog.insts.size(), -1),
+          _pc_samples(prog.insts.size(), 0) {
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before profiling");
+        }
+        find_functions(prog);
+        if (_mode == by_timer) {
+            start_timer();
+        }
+    }
+    ~profiler() {
+        if (_mode == by_timer) {
+            stop_timer();
+        }
+    }
+    profiler(const profiler&) = delete;
+    profiler& operator=(const profiler&) = delete;
+
+    static bool timer_supported() {
+#ifdef VMLUA_PROFILER_TIMER
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool before(vm& vm, program& prog) override {
+        if (_mode == by_instructions) {
+            if (--_countdown != 0) {
+                return true;
+            }
+            _countdown = _interval;
+        } else {
+            if (timer_fired() == 0) {
+                return true;
+            }
+            timer_fired() = 0;
+        }
+        sample(vm);
+        return true;
+    }
+
+    uint64_t samples() const { return _samples; }
+
+    // one line per distinct stack, "main;f;g <count>", as flamegraph.pl reads it
+    void write_collapsed(std::ostream& out) const {
+        for (auto& stack : _stacks) {
+            out << stack.first << " " << stack.second << '\n';
+        }
+    }
+
+    // functions by self samples, then the hottest instructions
+    void report(std::ostream& out, size_t top = 10) const {
+        out << "[profiler] " << _samples << " samples" << '\n';
+        if (_samples == 0) {
+            return;
+        }
+        std::vector<size_t> order(_functions.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+                  [this](size_t l, size_t r) { return _functions[l].self > _functions[r].self; });
+        out << std::setw(8) << "self %" << std::setw(9) << "total %"
+            << "  function" << '\n';
+        for (size_t i = 0; i < order.size() && i < top; i++) {
+            auto& fn = _functions[order[i]];
+            if (fn.total == 0) {
+                break;
+            }
+            out << std::setw(8) << percent(fn.self) << std::setw(9) << percent(fn.total) << "  " << fn.name << '\n';
+        }
+        std::vector<int32_t> pcs;
+        for (int32_t pc = 0; pc < _pc_samples.size(); pc++) {
+            if (_pc_samples[pc] > 0) {
+                pcs.push_back(pc);
+            }
+        }
+        std::sort(pcs.begin(), pcs.end(), [this](int32_t l, int32_t r) { return _pc_samples[l] > _pc_samples[r]; });
+        out << std::setw(8) << "pc" << std::setw(9) << "self %"
+            << "  function" << '\n';
+        for (size_t i = 0; i < pcs.size() && i < top; i++) {
+            out << std::setw(8) << pcs[i] << std::setw(9) << percent(_pc_samples[pcs[i]]) << "  "
+                << name_at(pcs[i]) << '\n';
+        }
+    }
+
+private:
+    std::string percent(uint64_t n) const {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(1) << 100.0 * n / _samples;
+        return ss.str();
+    }
+
+    std::string const& name_at(int32_t pc) const {
+        static const std::string unknown = "?";
+        return pc >= 0 && pc < _owner.size() && _owner[pc] >= 0 ? _functions[_owner[pc]].name : unknown;
+    }
+
+    void sample(vm& vm) {
+        auto pc = vm.program_counter();
+        if (pc < 0 || pc >= _owner.size()) {
+            return;
+        }
+        _samples++;
+        _pc_samples[pc]++;
+        // innermost first: the function running, then the caller of every frame
+        std::vector<int32_t> stack{_owner[pc]};
+        auto& frames = vm.call_frames();
+        for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+            // frames entered from native code return to pc -1
+            if (it->ret_pc > 0) {
+                stack.push_back(_owner[it->ret_pc - 1]);
+            }
+        }
+        if (stack.front() >= 0) {
+            _functions[stack.front()].self++;
+        }
+        std::set<int32_t> seen;
+        std::string collapsed;
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+            // recursion counts once towards total
+            if (*it >= 0 && seen.insert(*it).second) {
+                _functions[*it].total++;
+            }
+            collapsed += (collapsed.empty() ? "" : ";") + (*it >= 0 ? _functions[*it].name : std::string("?"));
+        }
+        _stacks[collapsed]++;
+    }
+
+    static bool terminates(opcode op) {
+        return op == op_ret || op == op_retval || op == op_jmp || op == op_tailcall || op == op_ret_fp ||
+               op == op_ret_k || op == op_ret_add_fp_fp;
+    }
+    static bool jumps(opcode op) { return op == op_jnz || op == op_jz || op == op_jmp || op == op_jncond; }
+
+    void find_functions(program const& prog) {
+        std::vector<int32_t> entries{prog.entry};
+        std::set<int32_t> seen{prog.entry};
+        for (auto& inst : prog.insts) {
+            if ((inst.op == op_call || inst.op == op_tailcall) && seen.insert(inst.a).second) {
+                entries.push_back(inst.a);
+            }
+        }
+        for (auto entry : entries) {
+            auto index = static_cast<int32_t>(_functions.size());
+            _functions.push_back(function{entry == prog.entry ? "main" : function_name(prog, entry)});
+            std::vector<int32_t> work{entry};
+            while (!work.empty()) {
+                auto pc = work.back();
+                work.pop_back();
+                if (pc < 0 || pc >= _owner.size() || _owner[pc] >= 0) {
+                    continue;
+                }
+                _owner[pc] = index;
+                auto& inst = prog.insts[pc];
+                if (jumps(inst.op)) {
+                    work.push_back(inst.a);
+                }
+                if (!terminates(inst.op)) {
+                    work.push_back(pc + 1);
+                }
+            }
+        }
+    }
+
+    static std::string function_name(program const& prog, int32_t loc) {
+        for (auto& sym : prog.syms) {
+            if (sym.second.function && sym.second.loc == loc) {
+                return sym.first;
+            }
+        }
+        return lb::string_util::concat("?", loc);
+    }
+
+#ifdef VMLUA_PROFILER_TIMER
+    static void on_timer(int) { timer_fired() = 1; }
+
+    void start_timer() {
+        timer_fired() = 0;
+        std::signal(SIGPROF, on_timer);
+        itimerval timer{};
+        timer.it_interval.tv_sec = _interval / 1000000;
+        timer.it_interval.tv_usec = _interval % 1000000;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+    void stop_timer() {
+        itimerval timer{};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        std::signal(SIGPROF, SIG_DFL);
+    }
+#else
+    void start_timer() {}
+    void stop_timer() {}
+#endif
+};
+}  // namespace lb::vmlua
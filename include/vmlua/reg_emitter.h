@@ -0,0 +1,359 @@
+#pragma once
+#include <climits>
+
+#include "reg_vm.h"
+namespace lb::vmlua {
+
+/**
+ * emits reg_vm code from the same ast the stack emitter consumes.
+ *
+ * slots of a frame are laid out as: parameters, then a slot for every local
+ * statement in the function body, then temporaries allocated in stack order.
+ * names resolve as in emitter: to the first declaration compiled so far, or
+ * to slot 0 if there is none. a call
+ * places its arguments at the first free temporary, which becomes the
+ * callee's fp, so the result is returned into that slot.
+ */
+class reg_emitter {
+private:
+    struct scope {
+        std::string name;
+        std::vector<reg_instruction> code;
+        std::map<std::string, int16_t> locals;
+        // every declaration has a slot of its own, even of a name declared before
+        std::map<local_stmt*, int16_t> slots;
+        // (index in code, callee) pairs patched once all functions are placed
+        std::vector<std::pair<size_t, std::string>> calls;
+        size_t nargs{0};
+        int16_t nlocals{0};
+        int16_t top{0};
+        size_t frame_size{0};
+    };
+    std::vector<scope> _functions;
+    std::map<int32_t, int16_t> _consts;
+    std::map<std::string, size_t> _arity;
+    native_registry const* _natives;
+
+public:
+    explicit reg_emitter(native_registry const* natives = nullptr) : _natives(natives) {}
+
+    reg_program compile(const ast& ast) {
+        reg_program prog;
+        prog.natives = _natives;
+        _functions.clear();
+        _consts.clear();
+        _arity.clear();
+        declare_functions(ast.stmts());
+
+        scope main;
+        declare_locals(main, ast.stmts());
+        for (auto&& stmt : ast) {
+            compile_statement(prog, main, stmt);
+        }
+        main.code.push_back(reg_instruction{rop_halt});
+        prog.frame_size = main.frame_size;
+
+        std::vector<std::pair<size_t, std::string>> calls;
+        place(prog, main, calls);
+        for (auto& fn : _functions) {
+            prog.funcs.insert({fn.name, reg_function{static_cast<int32_t>(prog.insts.size()), fn.nargs, fn.frame_size}});
+            place(prog, fn, calls);
+        }
+        for (auto& call : calls) {
+            auto it = prog.funcs.find(call.second);
+            if (it == prog.funcs.end()) {
+                throw std::runtime_error("undefined symbol: " + call.second);
+            }
+            auto& inst = prog.insts[call.first];
+            if (static_cast<size_t>(inst.b) < it->second.nargs) {
+                throw std::runtime_error(lb::string_util::concat("function ", call.second, " takes ",
+                                                                 it->second.nargs, " arguments, called with ", inst.b));
+            }
+            inst.d = it->second.loc;
+            inst.b = static_cast<int16_t>(it->second.nargs);
+            inst.c = static_cast<int16_t>(it->second.frame_size);
+        }
+        prog.consts.resize(_consts.size());
+        for (auto& k : _consts) {
+            prog.consts[-k.second - 1] = k.first;
+        }
+        return prog;
+    }
+
+private:
+    void place(reg_program& prog, scope& sc, std::vector<std::pair<size_t, std::string>>& calls) {
+        auto base = static_cast<int32_t>(prog.insts.size());
+        for (auto inst : sc.code) {
+            if (inst.op == rop_jmp || inst.op == rop_jz || inst.op == rop_jncond) {
+                inst.d += base;
+            }
+            prog.insts.push_back(inst);
+        }
+        for (auto& call : sc.calls) {
+            calls.push_back({base + call.first, call.second});
+        }
+    }
+
+    void declare_functions(const stmt_list& stmts) {
+        for (auto&& stmt : stmts) {
+            if (auto* p = node_cast<func_decl>(stmt)) {
+                if (_natives != nullptr) {
+                    _natives->check_declaration(to_string(p->name));
+                }
+                _arity.insert({to_string(p->name), p->params.size()});
+                declare_functions(p->body);
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                declare_functions(p->then_body);
+                declare_functions(p->else_body);
+            }
+        }
+    }
+
+    void declare_locals(scope& sc, const stmt_list& stmts) {
+        for (auto&& stmt : stmts) {
+            if (auto* p = node_cast<local_stmt>(stmt)) {
+                sc.slots.insert({p, sc.nlocals++});
+            } else if (auto* p = node_cast<if_stmt>(stmt)) {
+                declare_locals(sc, p->then_body);
+                declare_locals(sc, p->else_body);
+            }
+        }
+        sc.top = sc.nlocals;
+        sc.frame_size = std::max(sc.frame_size, static_cast<size_t>(sc.top));
+    }
+
+    // -1 if name is not a registered native
+    int32_t native_id(std::string const& name) const { return _natives != nullptr ? _natives->find(name) : -1; }
+
+    int16_t alloc(scope& sc) {
+        if (sc.top == INT16_MAX) {
+            throw std::runtime_error("too many registers in function " + sc.name);
+        }
+        auto slot = sc.top++;
+        sc.frame_size = std::max(sc.frame_size, static_cast<size_t>(sc.top));
+        return slot;
+    }
+
+    int16_t constant(int32_t value) {
+        auto it = _consts.find(value);
+        if (it != _consts.end()) {
+            return it->second;
+        }
+        if (_consts.size() == INT16_MAX) {
+            throw std::runtime_error("too many constants");
+        }
+        auto rk = static_cast<int16_t>(-static_cast<int32_t>(_consts.size()) - 1);
+        _consts.insert({value, rk});
+        return rk;
+    }
+
+    static bool to_logical_op(const std::string& oplit, logical_op& op) {
+        if (oplit == "<") {
+            op = LT;
+        } else if (oplit == ">") {
+            op = GT;
+        } else if (oplit == "<=") {
+            op = LE;
+        } else if (oplit == ">=") {
+            op = GE;
+        } else if (oplit == "==") {
+            op = EQ;
+        } else if (oplit == "!=") {
+            op = NE;
+        } else if (oplit == "&&" || oplit == "and") {
+            op = AND;
+        } else if (oplit == "||" || oplit == "or") {
+            op = OR;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void compile_statement(reg_program& prog, scope& sc, stmt_t* stmt) {
+        visit(stmt, overloaded{
+                        [&](if_stmt* p) { compile_if(prog, sc, p); },
+                        [&](local_stmt* p) {
+                            // the name is bound before its value is computed, as in emitter
+                            auto slot = sc.slots[p];
+                            sc.locals.insert({to_string(p->name), slot});
+                            compile_expr_to(prog, sc, p->expr, slot);
+                        },
+                        [&](ret_stmt* p) {
+                            // return f(x) reuses the frame, top level code has none to reuse
+                            auto* call = node_cast<func_call>(p->expr);
+                            auto builtin = call != nullptr && (to_string(call->name) == "print" ||
+                                                               native_id(to_string(call->name)) >= 0);
+                            if (!sc.name.empty() && call != nullptr && !builtin) {
+                                compile_call(prog, sc, call, true);
+                            } else {
+                                auto rk = compile_expr(prog, sc, p->expr);
+                                sc.code.push_back(reg_instruction{rop_ret, 0, 0, rk});
+                            }
+                        },
+                        [&](expr_stmt* p) { compile_expr(prog, sc, p->expr); },
+                        [&](func_decl* p) { compile_func_decl(prog, p); },
+                    });
+        // temporaries never outlive a statement
+        sc.top = sc.nlocals;
+    }
+
+    void compile_if(reg_program& prog, scope& sc, if_stmt* stmt) {
+        auto jump_else = compile_branch(prog, sc, stmt->condition);
+        for (auto&& stmt_ : stmt->then_body) {
+            compile_statement(prog, sc, stmt_);
+        }
+        if (stmt->else_body.empty()) {
+            sc.code[jump_else].d = static_cast<int32_t>(sc.code.size());
+            return;
+        }
+        auto jump_out = sc.code.size();
+        sc.code.push_back(reg_instruction{rop_jmp});
+        sc.code[jump_else].d = static_cast<int32_t>(sc.code.size());
+        for (auto&& stmt_ : stmt->else_body) {
+            compile_statement(prog, sc, stmt_);
+        }
+        sc.code[jump_out].d = static_cast<int32_t>(sc.code.size());
+    }
+
+    // emits a jump taken when cond is false and returns its index
+    size_t compile_branch(reg_program& prog, scope& sc, expr_t* cond) {
+        logical_op op;
+        auto* bin = node_cast<binary_op>(cond);
+        if (bin != nullptr && to_logical_op(to_string(bin->op), op) && op != AND && op != OR) {
+            auto saved = sc.top;
+            auto left = compile_expr(prog, sc, bin->left);
+            auto right = compile_expr(prog, sc, bin->right);
+            sc.top = saved;
+            sc.code.push_back(reg_instruction{rop_jncond, static_cast<uint8_t>(op), 0, left, right});
+        } else {
+            auto rk = compile_expr(prog, sc, cond);
+            sc.code.push_back(reg_instruction{rop_jz, 0, 0, rk});
+        }
+        return sc.code.size() - 1;
+    }
+
+    // returns the rk operand holding the value of expr
+    int16_t compile_expr(reg_program& prog, scope& sc, expr_t* expr) {
+        return visit(expr, overloaded{
+                               [&](literal_number* p) { return constant(std::stoi(to_string(p->token))); },
+                               [&](literal_id* p) {
+                                   auto it = sc.locals.find(to_string(p->token));
+                                   if (it != sc.locals.end()) {
+                                       return it->second;
+                                   }
+                                   // unknown names read slot 0, or 0 in a frame declaring
+                                   // nothing, as in emitter
+                                   return sc.nlocals > 0 ? int16_t{0} : constant(0);
+                               },
+                               [&](func_call* p) { return compile_call(prog, sc, p); },
+                               [&](binary_op* p) {
+                                   auto saved = sc.top;
+                                   auto left = compile_expr(prog, sc, p->left);
+                                   auto right = compile_expr(prog, sc, p->right);
+                                   sc.top = saved;
+                                   auto dst = alloc(sc);
+                                   emit_binary_op(sc, p, dst, left, right);
+                                   return dst;
+                               },
+                           });
+    }
+
+    void compile_expr_to(reg_program& prog, scope& sc, expr_t* expr, int16_t dst) {
+        if (auto* p = node_cast<binary_op>(expr)) {
+            auto saved = sc.top;
+            auto left = compile_expr(prog, sc, p->left);
+            auto right = compile_expr(prog, sc, p->right);
+            sc.top = saved;
+            emit_binary_op(sc, p, dst, left, right);
+            return;
+        }
+        auto rk = compile_expr(prog, sc, expr);
+        if (rk != dst) {
+            sc.code.push_back(reg_instruction{rop_move, 0, dst, rk});
+        }
+    }
+
+    void emit_binary_op(scope& sc, binary_op* op, int16_t dst, int16_t left, int16_t right) {
+        auto oplit = to_string(op->op);
+        logical_op cond;
+        if (oplit == "+") {
+            sc.code.push_back(reg_instruction{rop_add, 0, dst, left, right});
+        } else if (oplit == "-") {
+            sc.code.push_back(reg_instruction{rop_sub, 0, dst, left, right});
+        } else if (to_logical_op(oplit, cond)) {
+            sc.code.push_back(reg_instruction{rop_cond, static_cast<uint8_t>(cond), dst, left, right});
+        } else {
+            throw std::runtime_error("unknown operator");
+        }
+    }
+
+    // arguments are evaluated into consecutive slots starting at the first
+    // free temporary, which also receives the result
+    int16_t compile_call(reg_program& prog, scope& sc, func_call* fc, bool tail = false) {
+        auto base = sc.top;
+        for (size_t i = 0; i < fc->arguments.size(); i++) {
+            auto slot = static_cast<int16_t>(base + i);
+            sc.top = slot;
+            if (auto* p = node_cast<func_call>(fc->arguments[i])) {
+                compile_call(prog, sc, p);
+            } else {
+                alloc(sc);
+                compile_expr_to(prog, sc, fc->arguments[i], slot);
+            }
+        }
+        sc.top = base;
+        alloc(sc);
+        auto argc = static_cast<int16_t>(fc->arguments.size());
+        if (to_string(fc->name) == "print") {
+            sc.code.push_back(reg_instruction{rop_print, 0, base, argc});
+            return base;
+        }
+        auto id = native_id(to_string(fc->name));
+        if (id >= 0) {
+            _natives->check_call(id, argc);
+            sc.code.push_back(reg_instruction{rop_native, 0, base, argc, 0, id});
+            return base;
+        }
+        // like the stack engine, the callee binds the last nargs arguments
+        auto it = _arity.find(to_string(fc->name));
+        auto extra = it != _arity.end() && it->second < static_cast<size_t>(argc)
+                         ? static_cast<int16_t>(argc - it->second)
+                         : int16_t{0};
+        sc.calls.push_back({sc.code.size(), to_string(fc->name)});
+        if (tail) {
+            sc.code.push_back(reg_instruction{rop_tailcall, 0, static_cast<int16_t>(base + extra), argc});
+            return base;
+        }
+        sc.code.push_back(reg_instruction{rop_call, 0, static_cast<int16_t>(base + extra), argc});
+        if (extra > 0) {
+            sc.code.push_back(reg_instruction{rop_move, 0, base, static_cast<int16_t>(base + extra)});
+        }
+        return base;
+    }
+
+    void compile_func_decl(reg_program& prog, func_decl* fd) {
+        scope sc;
+        sc.name = to_string(fd->name);
+        sc.nargs = fd->params.size();
+        for (auto&& param : fd->params) {
+            sc.locals.insert({to_string(param), sc.nlocals++});
+        }
+        declare_locals(sc, fd->body);
+        for (auto&& stmt : fd->body) {
+            compile_statement(prog, sc, stmt);
+        }
+        // if user forget to return, we need to add a return inst; a branch
+        // may also jump past the last return
+        auto end = static_cast<int32_t>(sc.code.size());
+        auto falls_off = std::any_of(sc.code.begin(), sc.code.end(), [end](reg_instruction const& inst) {
+            return (inst.op == rop_jmp || inst.op == rop_jz || inst.op == rop_jncond) && inst.d == end;
+        });
+        auto back = sc.code.empty() ? rop_halt : sc.code.back().op;
+        if ((back != rop_ret && back != rop_tailcall) || falls_off) {
+            sc.code.push_back(reg_instruction{rop_ret, 0, 0, constant(0)});
+        }
+        _functions.push_back(std::move(sc));
+    }
+};
+}  // namespace lb::vmlua
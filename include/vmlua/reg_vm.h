@@ -0,0 +1,257 @@
+#pragma once
+#include <iomanip>
+#include <map>
+
+#include "vm.h"
+
+namespace lb::vmlua {
+
+/**
+ * register machine: three-address instructions operating directly on frame
+ * slots. operands named rk are either a slot (>= 0, relative to fp) or a
+ * constant (< 0, consts[-rk - 1]).
+ */
+enum reg_opcode : uint8_t {
+    rop_move,    // R(a) = rk(b)
+    rop_add,     // R(a) = rk(b) + rk(c)
+    rop_sub,     // R(a) = rk(b) - rk(c)
+    rop_cond,    // R(a) = rk(b) <x> rk(c)
+    rop_jmp,     // pc = d
+    rop_jz,      // if rk(b) == 0 then pc = d
+    rop_jncond,  // if not rk(b) <x> rk(c) then pc = d
+    rop_call,    // call d with its frame at R(a); b: nargs, c: frame size; result in R(a)
+    rop_tailcall,  // as rop_call, moving R(a) .. R(a + b - 1) down to R(0) and reusing the frame
+    rop_ret,     // return rk(b)
+    rop_print,   // print R(a) .. R(a + b - 1); R(a) = 0
+    rop_native,  // R(a) = natives[d](R(a) .. R(a + b - 1))
+    rop_halt,
+};
+
+struct reg_instruction {
+    reg_opcode op;
+    uint8_t x;
+    int16_t a;
+    int16_t b;
+    int16_t c;
+    int32_t d;
+
+    // operands left out are 0
+    reg_instruction(reg_opcode op = rop_halt, uint8_t x = 0, int16_t a = 0, int16_t b = 0, int16_t c = 0,
+                    int32_t d = 0)
+        : op(op), x(x), a(a), b(b), c(c), d(d) {}
+};
+static_assert(sizeof(reg_instruction) == 12, "reg_instruction must stay packed");
+
+struct reg_function {
+    int32_t loc;
+    size_t nargs;
+    size_t frame_size;
+};
+
+struct reg_program {
+    std::map<std::string, reg_function> funcs;
+    std::vector<reg_instruction> insts;
+    std::vector<int32_t> consts;
+    // slots of the top level frame
+    size_t frame_size{0};
+    // natives the rop_native ids index, set by the emitter
+    native_registry const* natives{nullptr};
+};
+
+class reg_vm {
+public:
+    static constexpr size_t default_stack_slots = vm::default_stack_slots;
+    static constexpr size_t default_max_frames = vm::default_max_frames;
+
+private:
+    int32_t pc{0};
+    int32_t fp{0};
+    std::vector<int32_t> stack;
+    std::vector<frame> frames;
+    size_t max_frames;
+    output* out{&output::standard()};
+
+public:
+    explicit reg_vm(size_t stack_slots = default_stack_slots, size_t max_frames = default_max_frames)
+        : stack(stack_slots, 0), max_frames(max_frames) {
+        frames.reserve(max_frames);
+    }
+
+    // where print writes to, output::standard() by default
+    void set_output(output* out) { this->out = out; }
+
+    void eval(reg_program& prog) {
+        pc = 0;
+        fp = 0;
+        frames.clear();
+        enter_frame(0, 0, prog.frame_size);
+        scope_guard flush([this]() { out->flush(); });
+        auto* consts = prog.consts.data();
+        auto rk = [&](int16_t v) { return v >= 0 ? stack[fp + v] : consts[-v - 1]; };
+        while (static_cast<size_t>(pc) < prog.insts.size()) {
+            auto& inst = prog.insts[pc];
+            switch (inst.op) {
+                case rop_move:
+                    stack[fp + inst.a] = rk(inst.b);
+                    pc++;
+                    break;
+                case rop_add:
+                    stack[fp + inst.a] = rk(inst.b) + rk(inst.c);
+                    pc++;
+                    break;
+                case rop_sub:
+                    stack[fp + inst.a] = rk(inst.b) - rk(inst.c);
+                    pc++;
+                    break;
+                case rop_cond:
+                    stack[fp + inst.a] = logic_cond(static_cast<logical_op>(inst.x), rk(inst.b), rk(inst.c));
+                    pc++;
+                    break;
+                case rop_jmp:
+                    pc = inst.d;
+                    break;
+                case rop_jz:
+                    pc = rk(inst.b) == 0 ? inst.d : pc + 1;
+                    break;
+                case rop_jncond:
+                    pc = logic_cond(static_cast<logical_op>(inst.x), rk(inst.b), rk(inst.c)) ? pc + 1 : inst.d;
+                    break;
+                case rop_call:
+                    if (frames.size() == max_frames) {
+                        throw std::runtime_error("stack overflow: too many nested calls");
+                    }
+                    frames.push_back(frame{pc + 1, fp});
+                    pc = inst.d;
+                    enter_frame(fp + inst.a, inst.b, inst.c);
+                    break;
+                case rop_tailcall:
+                    std::copy(stack.begin() + fp + inst.a, stack.begin() + fp + inst.a + inst.b, stack.begin() + fp);
+                    pc = inst.d;
+                    enter_frame(fp, inst.b, inst.c);
+                    break;
+                case rop_ret: {
+                    // a return at top level ends the script, as in the stack engine
+                    if (frames.empty()) {
+                        return;
+                    }
+                    stack[fp] = rk(inst.b);
+                    auto& f = frames.back();
+                    pc = f.ret_pc;
+                    fp = f.fp;
+                    frames.pop_back();
+                    break;
+                }
+                case rop_print:
+                    for (int i = inst.b - 1; i >= 0; i--) {
+                        out->write(stack[fp + inst.a + i]);
+                        out->put(' ');
+                    }
+                    out->end_line();
+                    stack[fp + inst.a] = 0;
+                    pc++;
+                    break;
+                case rop_native:
+                    stack[fp + inst.a] = (*prog.natives)[inst.d].fn(&stack[fp + inst.a], inst.b);
+                    pc++;
+                    break;
+                case rop_halt:
+                    return;
+                default:
+                    throw std::runtime_error("unknown instruction");
+            }
+        }
+    }
+
+    void show_asm(reg_program& prog) { show_asm(std::cout, prog); }
+    void show_asm(std::ostream& os, reg_program& prog) {
+        os << std::setw(8) << "--------"
+                  << "+------------------------------" << std::endl;
+        os << std::setw(8) << " OFFSET "
+                  << "| INSTRUCTION" << std::endl;
+        os << std::setw(8) << "--------"
+                  << "+------------------------------" << std::endl;
+        for (int32_t vpc = 0; static_cast<size_t>(vpc) < prog.insts.size(); vpc++) {
+            os << std::setw(8) << vpc << "| ";
+            for (auto& fn : prog.funcs) {
+                if (vpc == fn.second.loc) {
+                    os << fn.first << ": " << std::endl
+                              << std::setw(8) << " "
+                              << "| ";
+                }
+            }
+            os << std::setw(4) << " ";
+            auto& inst = prog.insts[vpc];
+            auto rk = [&](int16_t v) {
+                return v >= 0 ? lb::string_util::concat("R", v) : lb::string_util::concat("K(", prog.consts[-v - 1], ")");
+            };
+            switch (inst.op) {
+                case rop_move:
+                    os << "MOVE R" << inst.a << ", " << rk(inst.b) << std::endl;
+                    break;
+                case rop_add:
+                    os << "ADD R" << inst.a << ", " << rk(inst.b) << ", " << rk(inst.c) << std::endl;
+                    break;
+                case rop_sub:
+                    os << "SUB R" << inst.a << ", " << rk(inst.b) << ", " << rk(inst.c) << std::endl;
+                    break;
+                case rop_cond:
+                    os << "COND " << to_string(static_cast<logical_op>(inst.x)) << " R" << inst.a << ", "
+                              << rk(inst.b) << ", " << rk(inst.c) << std::endl;
+                    break;
+                case rop_jmp:
+                    os << "JMP " << inst.d << std::endl;
+                    break;
+                case rop_jz:
+                    os << "JZ " << rk(inst.b) << ", " << inst.d << std::endl;
+                    break;
+                case rop_jncond:
+                    os << "JN" << to_string(static_cast<logical_op>(inst.x)) << " " << rk(inst.b) << ", "
+                              << rk(inst.c) << ", " << inst.d << std::endl;
+                    break;
+                case rop_call:
+                    os << "CALL R" << inst.a << ", " << function_at(prog, inst.d) << "(" << inst.d
+                              << "), nargs=" << inst.b << ", frame=" << inst.c << std::endl;
+                    break;
+                case rop_tailcall:
+                    os << "TAILCALL R" << inst.a << ", " << function_at(prog, inst.d) << "(" << inst.d
+                              << "), nargs=" << inst.b << ", frame=" << inst.c << std::endl;
+                    break;
+                case rop_ret:
+                    os << "RET " << rk(inst.b) << std::endl;
+                    break;
+                case rop_print:
+                    os << "CALL print@internal R" << inst.a << ", ARGC=" << inst.b << std::endl;
+                    break;
+                case rop_native:
+                    os << "CALL " << (*prog.natives)[inst.d].name << "@native(" << inst.d << ") R" << inst.a
+                              << ", ARGC=" << inst.b << std::endl;
+                    break;
+                case rop_halt:
+                    os << "HALT" << std::endl;
+                    break;
+                default:
+                    throw std::runtime_error("unknown instruction");
+            }
+        }
+    }
+
+private:
+    static std::string function_at(reg_program const& prog, int32_t loc) {
+        for (auto& fn : prog.funcs) {
+            if (fn.second.loc == loc) {
+                return fn.first;
+            }
+        }
+        return "?";
+    }
+    // the first nargs slots are already in place
+    void enter_frame(int32_t new_fp, size_t nargs, size_t frame_size) {
+        if (new_fp + frame_size > stack.size()) {
+            throw std::runtime_error("stack overflow: value stack exhausted");
+        }
+        std::fill(stack.begin() + new_fp + nargs, stack.begin() + new_fp + frame_size, 0);
+        fp = new_fp;
+    }
+};
+
+}  // namespace lb::vmlua
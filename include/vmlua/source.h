@@ -0,0 +1,106 @@
+#pragma once
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VMLUA_SOURCE_MMAP 1
+#endif
+
+namespace lb::vmlua {
+
+/**
+ * the text of a script as one contiguous, read only buffer. files are mapped
+ * into memory where mmap is available and read in one go elsewhere.
+ *
+ * tokens are slices of text(), and the ast holds tokens, so a source must
+ * outlive everything compiled from it.
+ */
+class source {
+private:
+    std::string _name;
+    // owned text, unless the file is mapped
+    std::string _buffer;
+    void* _mapped{nullptr};
+    size_t _mapped_size{0};
+    std::string_view _text;
+
+    source() = default;
+
+public:
+    explicit source(std::string const& path) : _name(path) {
+#ifdef VMLUA_SOURCE_MMAP
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                _mapped = data;
+                _mapped_size = st.st_size;
+                _text = std::string_view(static_cast<char const*>(data), _mapped_size);
+            }
+        }
+        ::close(fd);
+        if (_mapped != nullptr) {
+            return;
+        }
+#endif
+        // empty files, pipes and platforms without mmap
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        std::ostringstream ss;
+        ss << file.rdbuf();
+        _buffer = ss.str();
+        _text = _buffer;
+    }
+    ~source() {
+#ifdef VMLUA_SOURCE_MMAP
+        if (_mapped != nullptr) {
+            ::munmap(_mapped, _mapped_size);
+        }
+#endif
+    }
+    source(const source&) = delete;
+    source& operator=(const source&) = delete;
+    source(source&& other) noexcept { *this = std::move(other); }
+    source& operator=(source&& other) noexcept {
+        std::swap(_name, other._name);
+        std::swap(_buffer, other._buffer);
+        std::swap(_mapped, other._mapped);
+        std::swap(_mapped_size, other._mapped_size);
+        // a moved std::string may have moved its characters along
+        auto owned = _mapped == nullptr, other_owned = other._mapped == nullptr;
+        std::swap(_text, other._text);
+        if (owned) {
+            _text = _buffer;
+        }
+        if (other_owned) {
+            other._text = other._buffer;
+        }
+        return *this;
+    }
+
+    // a script that is not in a file, such as a generated one
+    static source from_string(std::string text, std::string name = "<string>") {
+        source src;
+        src._name = std::move(name);
+        src._buffer = std::move(text);
+        src._text = src._buffer;
+        return src;
+    }
+
+    std::string_view text() const { return _text; }
+    std::string const& name() const { return _name; }
+    bool mapped() const { return _mapped != nullptr; }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,359 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <string>
+
+#include "vm.h"
+namespace lb::vmlua {
+
+/**
+ * counts of opcode sequences (pairs, triples, ...) in a linked program,
+ * weighted by how often the offset they start at runs. sequences never span
+ * a basic block leader, as they could not be fused.
+ */
+struct sequence_profile {
+    static constexpr size_t max_length = 4;
+    std::map<std::vector<opcode>, uint64_t> counts;
+    // executions of all instructions, with the same weights
+    uint64_t dispatches{0};
+
+    uint64_t count(std::vector<opcode> const& seq) const {
+        auto it = counts.find(seq);
+        return it == counts.end() ? 0 : it->second;
+    }
+};
+
+/**
+ * fuses frequent opcode sequences into the superinstructions declared in
+ * vm.h. every fusion the vm implements is a candidate; a program gets the
+ * max_fusions of them that save the most dispatches by the sequence counts
+ * measured on it, as long as each saves at least min_share of them.
+ *
+ * counts are executions from a profile, such as histogram::pc_counts() of a
+ * training run or the histogram json read back by read_executions, or else
+ * estimated from the code: top level code runs once, a function as often as
+ * its call sites together and a recursive one recursion_weight times that.
+ */
+class superinst {
+public:
+    static constexpr size_t default_max_fusions = 8;
+    static constexpr double default_min_share = 0.01;
+    static constexpr uint64_t recursion_weight = 16;
+
+    struct fusion {
+        std::vector<opcode> pattern;
+        opcode fused;
+        // encodes the matched sequence, fails if its operands do not fit
+        std::function<bool(instruction const* seq, instruction& out)> build;
+    };
+
+    struct selection {
+        fusion const* candidate;
+        uint64_t count;
+        uint64_t saved;
+    };
+
+    static std::vector<fusion> const& candidates() {
+        static auto slot = [](int32_t v) { return v >= 0 && v <= UINT16_MAX; };
+        static const std::vector<fusion> table = {
+            {{op_dup_plus_fp, op_dup_plus_fp}, op_push_fp2,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_push_fp2, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_store}, op_push_fp_k,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_push_fp_k, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_store, op_add}, op_add_fp_k,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_add_fp_k, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_store, op_sub}, op_sub_fp_k,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_sub_fp_k, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_dup_plus_fp, op_add}, op_add_fp_fp,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_add_fp_fp, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_dup_plus_fp, op_cond}, op_cond_fp_fp,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_cond_fp_fp, s[2].b, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_dup_plus_fp, op_store, op_cond}, op_cond_fp_k,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_cond_fp_k, s[2].b, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_cond, op_jz}, op_jncond,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_jncond, s[0].b, 0, s[1].a};
+                 return true;
+             }},
+            {{op_dup_plus_fp, op_retval}, op_ret_fp,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_ret_fp, 0, 0, s[0].a};
+                 return true;
+             }},
+            {{op_store, op_retval}, op_ret_k,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_ret_k, 0, 0, s[0].a};
+                 return true;
+             }},
+            {{op_dup_plus_fp, op_dup_plus_fp, op_add, op_retval}, op_ret_add_fp_fp,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_ret_add_fp_fp, 0, static_cast<uint16_t>(s[0].a), s[1].a};
+                 return slot(s[0].a);
+             }},
+            {{op_print, op_pop}, op_print_pop,
+             [](instruction const* s, instruction& out) {
+                 out = instruction{op_print_pop, 0, s[0].c, 0};
+                 return true;
+             }},
+        };
+        return table;
+    }
+
+    // counts every sequence of 2 .. max_length opcodes inside basic blocks,
+    // each occurrence as often as its first instruction is executed
+    sequence_profile measure(program const& prog, std::vector<uint64_t> const& executions) const {
+        sequence_profile profile;
+        auto leaders = find_leaders(prog);
+        for (size_t i = 0; i < prog.insts.size(); i++) {
+            profile.dispatches += executions[i];
+            if (executions[i] == 0) {
+                continue;
+            }
+            std::vector<opcode> seq{prog.insts[i].op};
+            for (size_t j = i + 1; j < prog.insts.size() && seq.size() < sequence_profile::max_length; j++) {
+                if (leaders[j] || ends_block(prog.insts[j - 1].op)) {
+                    break;
+                }
+                seq.push_back(prog.insts[j].op);
+                profile.counts[seq] += executions[i];
+            }
+        }
+        return profile;
+    }
+    sequence_profile measure(program const& prog) const { return measure(prog, estimate_executions(prog)); }
+
+    // executions of every offset from the "pcs" of a histogram json. the
+    // training run must have compiled the same script the same way, with
+    // superinstructions off, so that its offsets are those of prog
+    static std::vector<uint64_t> read_executions(std::istream& in, program const& prog) {
+        std::string json{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        std::vector<uint64_t> executions(prog.insts.size(), 0);
+        auto pos = json.find("\"pcs\"");
+        if (pos == std::string::npos) {
+            throw std::runtime_error("profile has no pcs");
+        }
+        while ((pos = json.find("\"pc\":", pos)) != std::string::npos) {
+            auto pc = std::strtoull(json.c_str() + pos + 5, nullptr, 10);
+            auto op_begin = json.find("\"op\": \"", pos) + 7;
+            auto op_end = json.find('"', op_begin);
+            auto count_at = json.find("\"count\":", op_end);
+            if (op_begin < 7 || op_end == std::string::npos || count_at == std::string::npos) {
+                throw std::runtime_error("malformed profile entry at byte " + std::to_string(pos));
+            }
+            if (pc >= prog.insts.size() || to_string(prog.insts[pc].op) != json.substr(op_begin, op_end - op_begin)) {
+                throw std::runtime_error("profile does not match the program at pc " + std::to_string(pc));
+            }
+            executions[pc] = std::strtoull(json.c_str() + count_at + 8, nullptr, 10);
+            pos = count_at;
+        }
+        return executions;
+    }
+
+    // candidates ranked by the dispatches they would save, keeping at most
+    // max_fusions of those saving at least min_share of all dispatches
+    std::vector<selection> select(sequence_profile const& profile, size_t max_fusions = default_max_fusions,
+                                  double min_share = default_min_share) const {
+        std::vector<selection> selected;
+        for (auto& f : candidates()) {
+            auto count = profile.count(f.pattern);
+            auto saved = count * (f.pattern.size() - 1);
+            if (count > 0 && saved >= min_share * profile.dispatches) {
+                selected.push_back(selection{&f, count, saved});
+            }
+        }
+        std::stable_sort(selected.begin(), selected.end(),
+                         [](selection const& l, selection const& r) { return l.saved > r.saved; });
+        if (selected.size() > max_fusions) {
+            selected.resize(max_fusions);
+        }
+        for (auto& sel : selected) {
+            VMLUA_TRACE(tc_emitter, tl_debug,
+                        "fuse " << to_string(sel.candidate->fused) << ", saves " << sel.saved << " of "
+                                << profile.dispatches << " dispatches");
+        }
+        return selected;
+    }
+
+    // executions of every offset estimated from the code alone, see superinst
+    static std::vector<uint64_t> estimate_executions(program const& prog) {
+        // the function each offset belongs to, by the code reached from its
+        // entry without calls. top level code is function 0
+        std::vector<int32_t> entries{prog.entry};
+        for (auto& sym : prog.syms) {
+            if (sym.second.function) {
+                entries.push_back(sym.second.loc);
+            }
+        }
+        std::vector<int32_t> owner(prog.insts.size(), -1);
+        // one entry per call site
+        std::vector<std::vector<size_t>> callees(entries.size());
+        for (size_t f = 0; f < entries.size(); f++) {
+            std::vector<int32_t> work{entries[f]};
+            while (!work.empty()) {
+                auto pc = work.back();
+                work.pop_back();
+                if (pc < 0 || static_cast<size_t>(pc) >= prog.insts.size() || owner[pc] == static_cast<int32_t>(f)) {
+                    continue;
+                }
+                owner[pc] = static_cast<int32_t>(f);
+                auto& inst = prog.insts[pc];
+                if (inst.op == op_call || inst.op == op_tailcall) {
+                    auto callee = std::find(entries.begin() + 1, entries.end(), inst.a);
+                    if (callee != entries.end()) {
+                        callees[f].push_back(callee - entries.begin());
+                    }
+                } else if (program::has_target(inst.op)) {
+                    work.push_back(inst.a);
+                }
+                if (inst.op != op_jmp && inst.op != op_tailcall && !is_return(inst.op)) {
+                    work.push_back(pc + 1);
+                }
+            }
+        }
+        // reach[f][g]: g can run while f is active
+        std::vector<std::vector<bool>> reach(entries.size(), std::vector<bool>(entries.size(), false));
+        for (size_t f = 0; f < entries.size(); f++) {
+            std::vector<size_t> work(callees[f].begin(), callees[f].end());
+            while (!work.empty()) {
+                auto g = work.back();
+                work.pop_back();
+                if (!reach[f][g]) {
+                    reach[f][g] = true;
+                    work.insert(work.end(), callees[g].begin(), callees[g].end());
+                }
+            }
+        }
+        // functions calling each other are weighted as one group, by the call
+        // sites into it from outside. as those callers are not in the group,
+        // a pass per function settles all weights
+        auto together = [&](size_t f, size_t g) { return f == g || (reach[f][g] && reach[g][f]); };
+        std::vector<uint64_t> weight(entries.size(), 0);
+        weight[0] = 1;
+        for (size_t round = 0; round < entries.size(); round++) {
+            for (size_t g = 1; g < entries.size(); g++) {
+                uint64_t w = 0;
+                for (size_t f = 0; f < entries.size(); f++) {
+                    for (auto h : callees[f]) {
+                        if (!together(f, g) && together(h, g)) {
+                            w = std::min<uint64_t>(w + weight[f], UINT32_MAX);
+                        }
+                    }
+                }
+                weight[g] = reach[g][g] ? w * recursion_weight : w;
+            }
+        }
+        std::vector<uint64_t> executions(prog.insts.size(), 0);
+        for (size_t pc = 0; pc < prog.insts.size(); pc++) {
+            if (owner[pc] >= 0) {
+                executions[pc] = weight[owner[pc]];
+            }
+        }
+        return executions;
+    }
+
+    // rewrites the program with the selected fusions, preferring the longest
+    // match at each offset. returns the number of instructions eliminated
+    size_t fuse(program& prog, std::vector<selection> const& selected) const {
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before fusing superinstructions");
+        }
+        auto leaders = find_leaders(prog);
+        auto& insts = prog.insts;
+        std::vector<instruction> code;
+        std::vector<int32_t> remap(insts.size() + 1);
+        size_t i = 0;
+        while (i < insts.size()) {
+            remap[i] = static_cast<int32_t>(code.size());
+            instruction fused{};
+            size_t len = 0;
+            for (auto& sel : selected) {
+                auto& pattern = sel.candidate->pattern;
+                if (pattern.size() <= len || !matches(insts, leaders, i, pattern)) {
+                    continue;
+                }
+                instruction out{};
+                if (sel.candidate->build(&insts[i], out)) {
+                    fused = out;
+                    len = pattern.size();
+                }
+            }
+            if (len == 0) {
+                code.push_back(insts[i++]);
+                continue;
+            }
+            code.push_back(fused);
+            // nothing jumps into the middle of a fused sequence
+            for (size_t k = 1; k < len; k++) {
+                remap[i + k] = remap[i];
+            }
+            i += len;
+        }
+        remap[insts.size()] = static_cast<int32_t>(code.size());
+        auto eliminated = insts.size() - code.size();
+        prog.relocate(std::move(code), remap);
+        return eliminated;
+    }
+
+private:
+    static bool is_return(opcode op) {
+        return op == op_ret || op == op_retval || op == op_ret_fp || op == op_ret_k || op == op_ret_add_fp_fp;
+    }
+    static bool ends_block(opcode op) { return program::has_target(op) || is_return(op) || op == op_tailcall; }
+
+    // offsets reached other than by falling through: jump and call targets,
+    // symbols and return addresses
+    static std::vector<bool> find_leaders(program const& prog) {
+        std::vector<bool> leaders(prog.insts.size() + 1, false);
+        for (size_t i = 0; i < prog.insts.size(); i++) {
+            auto& inst = prog.insts[i];
+            if (program::has_target(inst.op)) {
+                leaders[inst.a] = true;
+            }
+            if (inst.op == op_call) {
+                leaders[i + 1] = true;
+            }
+        }
+        for (auto& sym : prog.syms) {
+            leaders[sym.second.loc] = true;
+        }
+        return leaders;
+    }
+
+    static bool matches(std::vector<instruction> const& insts, std::vector<bool> const& leaders, size_t at,
+                        std::vector<opcode> const& pattern) {
+        if (at + pattern.size() > insts.size()) {
+            return false;
+        }
+        for (size_t k = 0; k < pattern.size(); k++) {
+            if (insts[at + k].op != pattern[k] || (k > 0 && leaders[at + k])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+}  // namespace lb::vmlua
@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "types.h"
+namespace lb::vmlua {
+
+// keywords, operators and syntax, which need no text of their own
+enum token_id : uint8_t {
+    // keywords
+    tk_function,
+    tk_end,
+    tk_if,
+    tk_elseif,
+    tk_else,
+    tk_while,
+    tk_do,
+    tk_in,
+    tk_nil,
+    tk_repeat,
+    tk_util,
+    tk_true,
+    tk_false,
+    tk_and,
+    tk_or,
+    tk_not,
+    tk_break,
+    tk_then,
+    tk_local,
+    tk_return,
+    // operators
+    tk_eq,
+    tk_ne,
+    tk_ge,
+    tk_le,
+    tk_plus,
+    tk_star,
+    tk_slash,
+    tk_caret,
+    tk_percent,
+    tk_gt,
+    tk_lt,
+    // syntax
+    tk_semicolon,
+    tk_assign,
+    tk_lparen,
+    tk_rparen,
+    tk_comma,
+    tk_count,
+};
+
+constexpr std::string_view spellings[] = {
+    "function", "end", "if", "elseif", "else", "while", "do", "in", "nil", "repeat", "util", "true",
+    "false",    "and", "or", "not",    "break", "then", "local", "return",  //
+    "==",       "!=",  ">=", "<=",     "+",    "*",     "/",  "^",  "%",   ">",      "<",  //
+    ";",        "=",   "(",  ")",      ",",
+};
+static_assert(std::size(spellings) == tk_count, "every token_id needs its spelling");
+
+constexpr std::string_view spelling(token_id id) { return spellings[id]; }
+
+constexpr token_kind kind_of(token_id id) {
+    return id < tk_eq ? t_keyword : id < tk_semicolon ? t_operator : t_syntax;
+}
+
+/**
+ * interned identifiers and numbers: every distinct text gets one handle.
+ * the strings are views of the source, or of intern_text for the few that
+ * are not in it.
+ */
+class string_table {
+private:
+    std::vector<std::string_view> _strings;
+    std::unordered_map<std::string_view, uint32_t> _handles;
+
+public:
+    uint32_t intern(std::string_view text) {
+        auto inserted = _handles.try_emplace(text, static_cast<uint32_t>(_strings.size()));
+        if (inserted.second) {
+            _strings.push_back(text);
+        }
+        return inserted.first->second;
+    }
+    std::string_view operator[](uint32_t handle) const { return _strings[handle]; }
+    size_t size() const { return _strings.size(); }
+};
+
+/**
+ * the tokens of a source as parallel arrays: the kind, a value that is the
+ * token_id of keywords, operators and syntax or the string_table handle of
+ * identifiers and numbers, and the offset in the source. lines and columns
+ * are found from the offsets of the line starts when a location is asked for.
+ *
+ * reading past the end yields t_eof tokens.
+ */
+class token_stream {
+private:
+    std::vector<uint8_t> _kinds;
+    std::vector<uint32_t> _values;
+    std::vector<uint32_t> _offsets;
+    // offset of the first character of every line
+    std::vector<uint32_t> _line_starts{0};
+    uint32_t _end{0};
+    string_table _strings;
+
+public:
+    void reserve(size_t n) {
+        _kinds.reserve(n);
+        _values.reserve(n);
+        _offsets.reserve(n);
+    }
+    void push(token_id id, size_t offset) { push(kind_of(id), id, offset); }
+    void push(token_kind kind, std::string_view text, size_t offset) { push(kind, _strings.intern(text), offset); }
+    void new_line(size_t offset) { _line_starts.push_back(static_cast<uint32_t>(offset)); }
+    // the end of the source, where t_eof tokens are
+    void finish(size_t offset) { _end = static_cast<uint32_t>(offset); }
+
+    size_t size() const { return _kinds.size(); }
+    token_kind kind(size_t i) const { return i < size() ? static_cast<token_kind>(_kinds[i]) : t_eof; }
+    // tk_count for identifiers, numbers and t_eof
+    token_id id(size_t i) const {
+        auto k = kind(i);
+        return k == t_keyword || k == t_operator || k == t_syntax ? static_cast<token_id>(_values[i]) : tk_count;
+    }
+    bool is(size_t i, token_id id) const { return this->id(i) == id; }
+    std::string_view literal(size_t i) const {
+        auto k = kind(i);
+        if (k == t_identifier || k == t_number) {
+            return _strings[_values[i]];
+        }
+        return k == t_eof ? std::string_view() : spelling(static_cast<token_id>(_values[i]));
+    }
+    location loc(size_t i) const { return locate(i < size() ? _offsets[i] : _end); }
+    location locate(size_t offset) const {
+        auto line = std::upper_bound(_line_starts.begin(), _line_starts.end(), offset) - _line_starts.begin();
+        return location(static_cast<int>(line), static_cast<int>(offset - _line_starts[line - 1] + 1), offset);
+    }
+    token_t operator[](size_t i) const { return token_t{kind(i), literal(i), loc(i)}; }
+
+    string_table const& strings() const { return _strings; }
+    // bytes held by the arrays, not counting the interned strings' hash table
+    size_t memory() const {
+        return _kinds.capacity() * sizeof(uint8_t) + (_values.capacity() + _offsets.capacity()) * sizeof(uint32_t) +
+               _line_starts.capacity() * sizeof(uint32_t) + _strings.size() * sizeof(std::string_view);
+    }
+
+private:
+    void push(token_kind kind, uint32_t value, size_t offset) {
+        _kinds.push_back(static_cast<uint8_t>(kind));
+        _values.push_back(value);
+        _offsets.push_back(static_cast<uint32_t>(offset));
+    }
+};
+
+inline std::string to_string(token_stream const& tokens) {
+    static const char *blue = "\033[34m", *red = "\033[31m", *reset = "\033[0m", *gray = "\033[37m";
+    std::stringstream ss;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        ss << std::endl << std::setw(4) << i << " | ";
+        auto kind = tokens.kind(i);
+        if (kind == t_keyword) {
+            ss << blue << tokens.literal(i) << reset;
+        } else if (kind == t_identifier) {
+            ss << gray << tokens.literal(i) << reset;
+        } else if (kind == t_number) {
+            ss << red << tokens.literal(i) << reset;
+        } else {
+            ss << tokens.literal(i);
+        }
+        ss << " ";
+    }
+    return ss.str();
+}
+}  // namespace lb::vmlua
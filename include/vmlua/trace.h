@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "output.h"
+
+// the most detailed trace_level compiled in, 0 leaves every trace out
+#ifndef VMLUA_TRACE_LEVEL
+#define VMLUA_TRACE_LEVEL 0
+#endif
+
+namespace lb::vmlua {
+
+enum trace_level : uint8_t {
+    tl_info = 1,   // a few lines per phase, such as the final listing
+    tl_debug = 2,  // lines per token, statement or call
+};
+
+enum trace_category : uint8_t {
+    tc_lexer,
+    tc_parser,
+    tc_emitter,
+    tc_vm,
+    tc_count,
+};
+
+constexpr std::string_view trace_names[] = {"lexer", "parser", "emitter", "vm"};
+static_assert(std::size(trace_names) == tc_count, "every trace_category needs its name");
+
+/**
+ * destination of the trace lines, written to stderr through a buffer of
+ * their own so that tracing neither flushes per line nor mixes into what
+ * scripts print. which categories are traced, and up to which level, is read
+ * from the environment once:
+ *
+ *   VM_LUA_TRACE=parser,vm      categories, or all; none are traced if unset
+ *   VM_LUA_TRACE_LEVEL=1        at most VMLUA_TRACE_LEVEL, which is the default
+ *
+ * lines are written with the VMLUA_TRACE macros only, which compile to nothing
+ * for levels above VMLUA_TRACE_LEVEL.
+ */
+class tracer {
+private:
+    uint32_t _categories{0};
+    int _level{VMLUA_TRACE_LEVEL};
+    std::ostringstream _line;
+    output _sink{stderr, output::default_capacity, output::flush_full};
+
+    tracer() {
+        auto categories = std::getenv("VM_LUA_TRACE");
+        if (categories != NULL) {
+            std::string_view list(categories);
+            while (!list.empty()) {
+                auto name = list.substr(0, list.find(','));
+                list.remove_prefix(std::min(list.size(), name.size() + 1));
+                for (uint8_t c = 0; c < tc_count; c++) {
+                    if (name == "all" || name == trace_names[c]) {
+                        _categories |= 1u << c;
+                    }
+                }
+            }
+        }
+        auto level = std::getenv("VM_LUA_TRACE_LEVEL");
+        if (level != NULL && level[0] >= '0' && level[0] <= '9') {
+            _level = std::min(std::atoi(level), VMLUA_TRACE_LEVEL);
+        }
+    }
+
+public:
+    tracer(const tracer&) = delete;
+    tracer& operator=(const tracer&) = delete;
+
+    static tracer& get() {
+        static tracer t;
+        return t;
+    }
+
+    bool enabled(trace_category category, trace_level level) const {
+        return level <= _level && (_categories & (1u << category)) != 0;
+    }
+
+    // the stream one line is formatted into, prefixed with its category
+    std::ostream& begin(trace_category category) {
+        _line.str("");
+        _line << "[" << trace_names[category] << "] ";
+        return _line;
+    }
+    void end_line() {
+        _line << '\n';
+        _sink.write(_line.str());
+    }
+
+    // a title line followed by the lines write puts on the stream, such as a listing
+    template <typename Writer>
+    void block(trace_category category, std::string_view title, Writer&& write) {
+        begin(category) << title << '\n';
+        write(static_cast<std::ostream&>(_line));
+        _sink.write(_line.str());
+    }
+
+    void flush() { _sink.flush(); }
+};
+
+// everything traced so far is out, as before a script runs and may crash
+inline void trace_flush() {
+    if constexpr (VMLUA_TRACE_LEVEL > 0) {
+        tracer::get().flush();
+    }
+}
+}  // namespace lb::vmlua
+
+// VMLUA_TRACE(tc_parser, tl_debug, "syntax tree: " << to_string(stmt));
+#define VMLUA_TRACE(category, level, ...)                                          \
+    do {                                                                           \
+        if constexpr ((level) <= VMLUA_TRACE_LEVEL) {                              \
+            if (::lb::vmlua::tracer::get().enabled(category, level)) {             \
+                ::lb::vmlua::tracer::get().begin(category) << __VA_ARGS__;         \
+                ::lb::vmlua::tracer::get().end_line();                             \
+            }                                                                      \
+        }                                                                          \
+    } while (0)
+
+// VMLUA_TRACE_BLOCK(tc_emitter, tl_info, "listing", [&](std::ostream& os) { vm.show_asm(os, prog); });
+#define VMLUA_TRACE_BLOCK(category, level, title, ...)                             \
+    do {                                                                           \
+        if constexpr ((level) <= VMLUA_TRACE_LEVEL) {                              \
+            if (::lb::vmlua::tracer::get().enabled(category, level)) {             \
+                ::lb::vmlua::tracer::get().block(category, title, __VA_ARGS__);    \
+            }                                                                      \
+        }                                                                          \
+    } while (0)
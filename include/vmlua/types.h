@@ -1,7 +1,15 @@
 #pragma once
+#include <functional>
+#include <iomanip>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
 
+#include "arena.h"
 #include "lb/util.h"
 
 namespace lb::vmlua {
@@ -76,12 +84,20 @@ struct location {
     }
 };
 
+// stable storage for token text that is not a slice of a source, such as
+// the numbers the constant folder computes
+inline std::string_view intern_text(std::string const& text) {
+    static std::unordered_set<std::string> pool;
+    return *pool.insert(text).first;
+}
+
+// literal is a slice of the source the token was read from, see source
 struct token_t {
     token_kind kind;
-    std::string literal;
+    std::string_view literal;
     location loc;
 
-    explicit token_t(token_kind kind = token_kind::t_unk, std::string literal = "",
+    explicit token_t(token_kind kind = token_kind::t_unk, std::string_view literal = "",
                      location loc = location{0, 0, 0}) noexcept
         : kind(kind), literal(literal), loc(loc) {}
 
@@ -95,129 +111,200 @@ const static token_t tok_eof{token_kind::t_eof, "", location{0, 0, 0}};
 const static token_t tok_unk{token_kind::t_unk, "", location{0, 0, 0}};
 
 /**
- * AST
+ * AST, allocated from the arena of the ast that holds it. nodes refer to each
+ * other by plain pointers and die with their ast.
+ *
+ * every node carries the node_kind of its type, which passes switch on
+ * through visit() or test with node_cast<T>() instead of using rtti.
  */
-struct stmt_t {
-    virtual ~stmt_t() {}
+enum node_kind : uint8_t {
+    // expressions
+    n_literal_id,
+    n_literal_number,
+    n_func_call,
+    n_binary_op,
+    // statements
+    n_func_decl,
+    n_if_stmt,
+    n_local_stmt,
+    n_ret_stmt,
+    n_expr_stmt,
 };
 
-typedef std::vector<std::unique_ptr<stmt_t>> ast;
+struct stmt_t {
+    node_kind const kind;
+
+protected:
+    explicit stmt_t(node_kind kind) : kind(kind) {}
+};
 
 struct expr_t {
-    virtual ~expr_t(){};
-    virtual std::unique_ptr<expr_t> clone() const = 0;
+    node_kind const kind;
+
+protected:
+    explicit expr_t(node_kind kind) : kind(kind) {}
 };
 
+typedef std::vector<stmt_t*> stmt_list;
+typedef std::vector<expr_t*> expr_list;
+
 struct literal_t : public expr_t {
-    virtual ~literal_t() {}
+protected:
+    using expr_t::expr_t;
 };
 
 struct literal_id : public literal_t {
+    static constexpr node_kind tag = n_literal_id;
     token_t token{tok_unk};
 
-    literal_id(token_t token) : token(token) {}
-
-    std::unique_ptr<expr_t> clone() const override { return std::make_unique<literal_id>(token); }
+    literal_id(token_t token) : literal_t(tag), token(token) {}
 };
 struct literal_number : public literal_t {
+    static constexpr node_kind tag = n_literal_number;
     token_t token{tok_unk};
 
-    literal_number(token_t token) : token(token) {}
-
-    std::unique_ptr<expr_t> clone() const override { return std::make_unique<literal_number>(token); }
+    literal_number(token_t token) : literal_t(tag), token(token) {}
 };
 
 struct func_call : public expr_t {
+    static constexpr node_kind tag = n_func_call;
     token_t name;
-    std::vector<std::unique_ptr<expr_t>> arguments;
+    expr_list arguments;
 
-    func_call(token_t name, std::vector<std::unique_ptr<expr_t>>& arguments) : name(name) {
-        for (auto&& arg : arguments) {
-            this->arguments.push_back(std::move(arg));
-        }
-    }
-
-    std::unique_ptr<expr_t> clone() const override {
-        std::vector<std::unique_ptr<expr_t>> args;
-        for (auto&& arg : arguments) {
-            args.push_back(arg->clone());
-        }
-        return std::make_unique<func_call>(name, args);
-    }
+    func_call(token_t name, expr_list arguments) : expr_t(tag), name(name), arguments(std::move(arguments)) {}
 };
 
 struct binary_op : public expr_t {
+    static constexpr node_kind tag = n_binary_op;
     token_t op;
-    std::unique_ptr<expr_t> left;
-    std::unique_ptr<expr_t> right;
+    expr_t* left;
+    expr_t* right;
 
-    binary_op(token_t op, std::unique_ptr<expr_t>& left, std::unique_ptr<expr_t>& right)
-        : op(op), left(std::move(left)), right(std::move(right)) {}
-
-    std::unique_ptr<expr_t> clone() const override {
-        auto newleft = left->clone();
-        auto newright = right->clone();
-        return std::make_unique<binary_op>(op, newleft, newright);
-    }
+    binary_op(token_t op, expr_t* left, expr_t* right) : expr_t(tag), op(op), left(left), right(right) {}
 };
 
 struct func_decl : public stmt_t {
+    static constexpr node_kind tag = n_func_decl;
     token_t name;
-    std::vector<std::unique_ptr<token_t>> params;
-    std::vector<std::unique_ptr<stmt_t>> body;
+    std::vector<token_t> params;
+    stmt_list body;
 
-    func_decl(token_t name, std::vector<std::unique_ptr<token_t>>& params, std::vector<std::unique_ptr<stmt_t>>& body)
-        : name(name) {
-        for (auto&& param : params) {
-            this->params.push_back(std::move(param));
-        }
-        for (auto&& stmt : body) {
-            this->body.push_back(std::move(stmt));
-        }
-    }
+    func_decl(token_t name, std::vector<token_t> params, stmt_list body)
+        : stmt_t(tag), name(name), params(std::move(params)), body(std::move(body)) {}
 };
 
 struct if_stmt : public stmt_t {
-    std::unique_ptr<expr_t> condition;
-    std::vector<std::unique_ptr<stmt_t>> then_body;
-    std::vector<std::unique_ptr<stmt_t>> else_body;
-
-    if_stmt(std::unique_ptr<expr_t>& condition, std::vector<std::unique_ptr<stmt_t>>& then_body,
-            std::vector<std::unique_ptr<stmt_t>>& else_body)
-        : condition(std::move(condition)) {
-        for (auto&& stmt : then_body) {
-            this->then_body.push_back(std::move(stmt));
-        }
-        for (auto&& stmt : else_body) {
-            this->else_body.push_back(std::move(stmt));
-        }
-    }
+    static constexpr node_kind tag = n_if_stmt;
+    expr_t* condition;
+    stmt_list then_body;
+    stmt_list else_body;
+
+    if_stmt(expr_t* condition, stmt_list then_body, stmt_list else_body)
+        : stmt_t(tag), condition(condition), then_body(std::move(then_body)), else_body(std::move(else_body)) {}
 };
 
 struct local_stmt : public stmt_t {
+    static constexpr node_kind tag = n_local_stmt;
     token_t name;
-    std::unique_ptr<expr_t> expr;
+    expr_t* expr;
 
-    local_stmt(token_t name, std::unique_ptr<expr_t>& e) : name(name), expr(std::move(e)) {}
+    local_stmt(token_t name, expr_t* e) : stmt_t(tag), name(name), expr(e) {}
 };
 
 struct ret_stmt : public stmt_t {
-    std::unique_ptr<expr_t> expr;
+    static constexpr node_kind tag = n_ret_stmt;
+    expr_t* expr;
 
-    ret_stmt(std::unique_ptr<expr_t>& e) : expr(std::move(e)) {}
+    ret_stmt(expr_t* e) : stmt_t(tag), expr(e) {}
 };
 
 struct expr_stmt : public stmt_t {
-    std::unique_ptr<expr_t> expr;
+    static constexpr node_kind tag = n_expr_stmt;
+    expr_t* expr;
 
-    expr_stmt(std::unique_ptr<expr_t>& e) : expr(std::move(e)) {}
+    expr_stmt(expr_t* e) : stmt_t(tag), expr(e) {}
+};
+
+// the node as a T, nullptr if it is a node of another kind
+template <typename T, typename Node>
+T* node_cast(Node* node) {
+    return node != nullptr && node->kind == T::tag ? static_cast<T*>(node) : nullptr;
+}
+
+// a visitor made of one lambda per node type, with an auto* one for the rest:
+//   visit(e, overloaded{[](binary_op* p) { ... }, [](auto*) { ... }});
+template <typename... Fs>
+struct overloaded : Fs... {
+    using Fs::operator()...;
+};
+template <typename... Fs>
+overloaded(Fs...) -> overloaded<Fs...>;
+
+// calls the visitor with the node as a pointer to its own type
+template <typename Visitor>
+decltype(auto) visit(expr_t* e, Visitor&& v) {
+    switch (e->kind) {
+        case n_literal_id:
+            return v(static_cast<literal_id*>(e));
+        case n_literal_number:
+            return v(static_cast<literal_number*>(e));
+        case n_func_call:
+            return v(static_cast<func_call*>(e));
+        case n_binary_op:
+            return v(static_cast<binary_op*>(e));
+        default:
+            throw std::runtime_error("unknown expression");
+    }
+}
+
+template <typename Visitor>
+decltype(auto) visit(stmt_t* stmt, Visitor&& v) {
+    switch (stmt->kind) {
+        case n_func_decl:
+            return v(static_cast<func_decl*>(stmt));
+        case n_if_stmt:
+            return v(static_cast<if_stmt*>(stmt));
+        case n_local_stmt:
+            return v(static_cast<local_stmt*>(stmt));
+        case n_ret_stmt:
+            return v(static_cast<ret_stmt*>(stmt));
+        case n_expr_stmt:
+            return v(static_cast<expr_stmt*>(stmt));
+        default:
+            throw std::runtime_error("unknown statement");
+    }
+}
+
+/**
+ * a parsed script: its top level statements and the arena every node of the
+ * tree lives in. passes that add nodes make them here too.
+ */
+class ast {
+private:
+    arena _nodes;
+    stmt_list _stmts;
+
+public:
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return _nodes.make<T>(std::forward<Args>(args)...);
+    }
+
+    stmt_list& stmts() { return _stmts; }
+    stmt_list const& stmts() const { return _stmts; }
+    stmt_list::const_iterator begin() const { return _stmts.begin(); }
+    stmt_list::const_iterator end() const { return _stmts.end(); }
+    size_t size() const { return _stmts.size(); }
+    void push_back(stmt_t* stmt) { _stmts.push_back(stmt); }
+
+    // bytes of nodes, not counting the lists of children
+    size_t memory() const { return _nodes.allocated(); }
 };
 
 std::string to_string(expr_t* v);
 std::string to_string(token_t* v);
 std::string to_string(token_t& t);
 std::string to_string(std::vector<token_t>& v);
-std::string to_string(std::vector<std::unique_ptr<token_t>>& v);
 std::string to_string(literal_t& v);
 std::string to_string(literal_id& v);
 std::string to_string(literal_number& v);
@@ -230,35 +317,13 @@ std::string to_string(local_stmt* v);
 std::string to_string(ret_stmt* v);
 std::string to_string(expr_stmt* v);
 
-std::string to_string(token_t* t) { return t->literal; }
-std::string to_string(token_t& t) { return t.literal; }
+std::string to_string(token_t* t) { return std::string(t->literal); }
+std::string to_string(token_t& t) { return std::string(t.literal); }
 std::string to_string(std::vector<token_t>& v) {
-    static const char *blue = "\033[34m", *red = "\033[31m", *green = "\033[32m", *reset = "\033[0m",
-                      *gray = "\033[37m";
-    std::stringstream ss;
-    int index = 0;
-    auto newline = [&]() { ss << std::endl << std::setw(4) << index++ << " | "; };
-    for (auto&& t : v) {
-        newline();
-        if (t.kind == t_keyword) {
-            ss << blue << t.literal << reset;
-        } else if (t.kind == t_identifier) {
-            ss << gray << t.literal << reset;
-        } else if (t.kind == t_number) {
-            ss << red << t.literal << reset;
-        } else {
-            ss << t.literal;
-        }
-        ss << " ";
-    }
-    return ss.str();
-}
-
-std::string to_string(std::vector<std::unique_ptr<token_t>>& v) {
     // std::cout << "[debug] call token_t>& v) " << std::endl;
     std::stringstream ss;
     for (int i = 0; i < v.size(); i++) {
-        ss << to_string(*v[i]);
+        ss << to_string(v[i]);
         if (i != v.size() - 1) {
             ss << " ";
         }
@@ -266,53 +331,28 @@ std::string to_string(std::vector<std::unique_ptr<token_t>>& v) {
     return ss.str();
 }
 
-std::string to_string(literal_id& v) {
-    // std::cout << "[debug] call to_string(literal_id& v)" << std::endl;
-    return "id " + to_string(v.token);
-}
+std::string to_string(literal_id& v) { return "id (" + to_string(v.token) + ")"; }
 
-std::string to_string(literal_number& v) {
-    // std::cout << "[debug] call to_string(literal_number& v)" << std::endl;
-    return "number " + to_string(v.token);
-}
+std::string to_string(literal_number& v) { return "number (" + to_string(v.token) + ")"; }
 
-std::string to_string(literal_t& v) {
-    // std::cout << "[debug] call to_string(literal_t& v)" << std::endl;
-    if (auto* p = dynamic_cast<literal_id*>(&v)) {
-        return "id (" + to_string(p->token) + ")";
-    } else if (auto* p = dynamic_cast<literal_number*>(&v)) {
-        return "number (" + to_string(p->token) + ")";
-    } else {
-        return "unknown literal_t";
-    }
-}
+std::string to_string(literal_t& v) { return to_string(static_cast<expr_t*>(&v)); }
 
 std::string to_string(expr_t* v) {
-    // std::cout << "[debug] call to_string(expr_t* v)" << std::endl;
-    if (auto* p = dynamic_cast<literal_t*>(v)) {
-        return to_string(*p);
-    } else if (auto* p = dynamic_cast<func_call*>(v)) {
-        return to_string(*p);
-    } else if (auto* p = dynamic_cast<binary_op*>(v)) {
-        return to_string(*p);
-    } else {
-        std::cout << "unknown expr_t typeid: " << typeid(v).name() << std::endl;
-        return "unknown expr_t";
-    }
+    return visit(v, [](auto* p) { return to_string(*p); });
 }
 
 std::string to_string(func_call& v) {
     // std::cout << "[debug] call to_string(func_call& v)" << std::endl;
     std::string args;
     for (auto& e : v.arguments) {
-        args += to_string(e.get()) + " ";
+        args += to_string(e) + " ";
     }
     return "func_call ( " + to_string(v.name) + " ( " + args + " ) )";
 }
 
 std::string to_string(binary_op& v) {
     // std::cout << "[debug] call to_string(binary_op& v)" << std::endl;
-    return "binary_op ( " + to_string(v.op) + " ( " + to_string(v.left.get()) + " ) ( " + to_string(v.right.get()) +
+    return "binary_op ( " + to_string(v.op) + " ( " + to_string(v.left) + " ) ( " + to_string(v.right) +
            " ) )";
 }
 
@@ -320,11 +360,11 @@ std::string to_string(func_decl* v) {
     // std::cout << "[debug] call to_string(func_decl* v)" << std::endl;
     std::string params;
     for (auto& e : v->params) {
-        params += "(" + to_string(e.get()) + " )";
+        params += "(" + to_string(e) + " )";
     }
     std::string body;
     for (auto& e : v->body) {
-        body += "(" + to_string(e.get()) + " )";
+        body += "(" + to_string(e) + " )";
     }
     return "func_decl ( " + to_string(v->name) + " ( " + params + " ) ( " + body + " ) )";
 }
@@ -333,54 +373,41 @@ std::string to_string(stmt_t* v) {
     if (v == nullptr) {
         throw std::runtime_error("unreachable");
     }
-    // std::cout << "[debug] call to_string(stmt_t* v)" << std::endl;
-    if (auto* p = dynamic_cast<if_stmt*>(v)) {
-        return to_string(p);
-    } else if (auto* p = dynamic_cast<local_stmt*>(v)) {
-        return to_string(p);
-    } else if (auto* p = dynamic_cast<ret_stmt*>(v)) {
-        return to_string(p);
-    } else if (auto* p = dynamic_cast<expr_stmt*>(v)) {
-        return to_string(p);
-    } else if (auto* p = dynamic_cast<func_decl*>(v)) {
-        return to_string(p);
-    } else {
-        return "unknown stmt_t";
-    }
+    return visit(v, [](auto* p) { return to_string(p); });
 }
 
 std::string to_string(if_stmt* v) {
     // std::cout << "[debug] call to_string(if_stmt* v)" << std::endl;
     std::string body;
     for (int i = 0; i < v->then_body.size(); i++) {
-        body += "(" + to_string(v->then_body[i].get()) + ")";
+        body += "(" + to_string(v->then_body[i]) + ")";
         if (i != v->then_body.size() - 1) {
             body += " ";
         }
     }
     std::string else_body;
     for (int i = 0; i < v->else_body.size(); i++) {
-        else_body += "(" + to_string(v->else_body[i].get()) + ")";
+        else_body += "(" + to_string(v->else_body[i]) + ")";
         if (i != v->else_body.size() - 1) {
             else_body += " ";
         }
     }
-    return "if_stmt (cond ( " + to_string(v->condition.get()) + " ) (then ( " + body + " ) ) (else " + else_body +
+    return "if_stmt (cond ( " + to_string(v->condition) + " ) (then ( " + body + " ) ) (else " + else_body +
            " ) )";
 }
 
 std::string to_string(local_stmt* v) {
     // std::cout << "[debug] call to_string(local_stmt* v)" << std::endl;
-    return "local_stmt ( " + to_string(v->name) + " " + to_string(v->expr.get()) + " )";
+    return "local_stmt ( " + to_string(v->name) + " " + to_string(v->expr) + " )";
 }
 
 std::string to_string(ret_stmt* v) {
     // std::cout << "[debug] call to_string(ret_stmt* v)" << std::endl;
-    return "ret_stmt ( " + to_string(v->expr.get()) + " )";
+    return "ret_stmt ( " + to_string(v->expr) + " )";
 }
 
 std::string to_string(expr_stmt* v) {
     // std::cout << "[debug] call to_string(expr_stmt* v)" << std::endl;
-    return "expr_stmt ( " + to_string(v->expr.get()) + " )";
+    return "expr_stmt ( " + to_string(v->expr) + " )";
 }
 }  // namespace lb::vmlua
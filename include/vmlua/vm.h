@@ -1,369 +1,658 @@
 #pragma once
+#include <algorithm>
+#include <cassert>
 #include <iomanip>
 #include <map>
 
+#include "memo.h"
+#include "natives.h"
+#include "output.h"
+#include "trace.h"
 #include "types.h"
 
 namespace lb::vmlua {
-struct instruction {
-    virtual ~instruction() {}
-};
-
-struct dup_plus_fp_inst : public instruction {
-    int32_t offset;
-
-    dup_plus_fp_inst(int32_t offset) : offset(offset) {}
-};
-struct move_minus_fp_inst : public instruction {
-    size_t local_off;
-    int32_t fp_off;
+enum opcode : uint8_t {
+    op_add,
+    op_sub,
+    op_cond,          // b: logical_op
+    op_dup_plus_fp,   // a: slot offset
+    op_move_plus_fp,  // a: slot offset
+    op_store,         // a: immediate
+    op_pop,
+    op_ret,
+    op_retval,
+    op_jnz,    // a: label, offset once linked
+    op_jz,     // a: label, offset once linked
+    op_jmp,    // a: label, offset once linked
+    op_call,   // a: label, c: argc; linked: a: offset, b: nargs, c: nlocals
+    op_tailcall,  // as op_call, reusing the current frame
+    op_print,  // c: argc
+    op_native,  // a: native id, c: argc
 
-    move_minus_fp_inst(size_t local_off, int32_t fp_off) : local_off(local_off), fp_off(fp_off) {}
+    // superinstructions, only produced on linked programs by superinst.h
+    op_push_fp2,       // PUSH FP + c; PUSH FP + a
+    op_push_fp_k,      // PUSH FP + c; PUSH a
+    op_add_fp_k,       // PUSH FP + c; PUSH a; ADD
+    op_sub_fp_k,       // PUSH FP + c; PUSH a; SUB
+    op_add_fp_fp,      // PUSH FP + c; PUSH FP + a; ADD
+    op_cond_fp_fp,     // PUSH FP + c; PUSH FP + a; COND b
+    op_cond_fp_k,      // PUSH FP + c; PUSH a; COND b
+    op_jncond,         // COND b; JZ a
+    op_ret_fp,         // PUSH FP + a; RETVAL
+    op_ret_k,          // PUSH a; RETVAL
+    op_ret_add_fp_fp,  // PUSH FP + c; PUSH FP + a; ADD; RETVAL
+    op_print_pop,      // PRINT c; POP
+    opcode_count,
 };
-struct move_plus_fp_inst : public instruction {
-    size_t value;
 
-    move_plus_fp_inst(size_t value) : value(value) {}
-};
-struct store_inst : public instruction {
-    int32_t n;
-
-    store_inst(int32_t offset) : n(offset) {}
-};
-struct return_inst : public instruction {
-    bool has_value;
-    return_inst(bool has_value = true) : has_value(has_value) {}
-};
-struct jump_if_not_zero_inst : public instruction {
-    std::string label;
+enum logical_op : uint8_t { AND, OR, LT, GT, LE, GE, EQ, NE };
 
-    jump_if_not_zero_inst(std::string label) : label(label) {}
-};
-struct jump_if_zero_inst : public instruction {
-    std::string label;
+inline std::string to_string(logical_op op) {
+    switch (op) {
+        case AND:
+            return "AND";
+        case OR:
+            return "OR";
+        case LT:
+            return "LT";
+        case GT:
+            return "GT";
+        case LE:
+            return "LE";
+        case GE:
+            return "GE";
+        case EQ:
+            return "EQ";
+        case NE:
+            return "NE";
+    }
+    return "UNKNOWN";
+}
 
-    jump_if_zero_inst(std::string label) : label(label) {}
-};
-struct jump_inst : public instruction {
-    std::string label;
+inline std::string to_string(opcode op) {
+    static const char* names[] = {
+        "add",      "sub",       "cond",       "dup_plus_fp", "move_plus_fp", "store",         "pop",
+        "ret",      "retval",    "jnz",        "jz",          "jmp",          "call",          "tailcall",
+        "print",    "native",    "push_fp2",   "push_fp_k",   "add_fp_k",     "sub_fp_k",      "add_fp_fp",
+        "cond_fp_fp", "cond_fp_k", "jncond",   "ret_fp",      "ret_k",        "ret_add_fp_fp", "print_pop",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == opcode_count, "every opcode needs a name");
+    return op < opcode_count ? names[op] : "unknown";
+}
 
-    jump_inst(std::string label) : label(label) {}
-};
-struct call_inst : public instruction {
-    std::string label;
-    size_t argc;
+inline int32_t logic_cond(logical_op op, int32_t left, int32_t right) {
+    switch (op) {
+        case AND:
+            return left & right;
+        case OR:
+            return left | right;
+        case LT:
+            return left < right;
+        case GT:
+            return left > right;
+        case LE:
+            return left <= right;
+        case GE:
+            return left >= right;
+        case EQ:
+            return left == right;
+        case NE:
+            return left != right;
+    }
+    return 0;
+}
 
-    call_inst(std::string label, size_t argc) : label(label), argc(argc) {}
-};
-struct add_inst : public instruction {
-    add_inst() {}
-};
-struct subtract_inst : public instruction {
-    subtract_inst() {}
-};
-enum logical_op { AND, OR, LT, GT, LE, GE, EQ, NE };
-struct logic_cond_inst : public instruction {
-    logical_op op;
-    logic_cond_inst(logical_op op) : op(op) {}
+/**
+ * fixed-width 64-bit instruction word
+ */
+struct instruction {
+    opcode op;
+    uint8_t b;
+    uint16_t c;
+    int32_t a;
 };
+static_assert(sizeof(instruction) == 8, "instruction must be packed into one 64-bit word");
 
 struct symbol {
     int32_t loc;
     size_t nargs;
     size_t nlocals;
+    // a function rather than a label inside code
+    bool function{false};
+    // reads nothing but its arguments and calls only pure functions
+    bool pure{false};
+    // results of a pure function, allocated by the vm in memoization mode
+    std::shared_ptr<memo_table> memo;
 };
 
 struct program {
     std::map<std::string, symbol> syms;
-    std::vector<std::unique_ptr<instruction>> insts;
+    // locals of the top level frame
+    size_t nlocals{0};
+    // offset the top level code starts at
+    int32_t entry{0};
+    // natives the op_native ids index, set by the emitter
+    native_registry const* natives{nullptr};
+    std::vector<instruction> insts;
+    // label operands index into this table until the program is linked
+    std::vector<std::string> labels;
+    std::map<std::string, int32_t> label_ids;
+    bool linked{false};
+
+    void emit(opcode op, int32_t a = 0, uint16_t c = 0, uint8_t b = 0) { insts.push_back(instruction{op, b, c, a}); }
+
+    int32_t label(std::string const& name) {
+        auto it = label_ids.find(name);
+        if (it != label_ids.end()) {
+            return it->second;
+        }
+        auto id = static_cast<int32_t>(labels.size());
+        labels.push_back(name);
+        label_ids.insert(std::make_pair(name, id));
+        return id;
+    }
+
+    static bool has_target(opcode op) {
+        return op == op_jnz || op == op_jz || op == op_jmp || op == op_call || op == op_tailcall || op == op_jncond;
+    }
+
+    // replaces the code of a linked program. remap maps every old offset,
+    // including the end of the program, to its new offset
+    void relocate(std::vector<instruction> code, std::vector<int32_t> const& remap) {
+        for (auto& inst : code) {
+            if (has_target(inst.op)) {
+                inst.a = remap[inst.a];
+            }
+        }
+        for (auto& sym : syms) {
+            sym.second.loc = remap[sym.second.loc];
+        }
+        entry = remap[entry];
+        insts = std::move(code);
+    }
+};
+
+/**
+ * frame layout on the value stack:
+ *
+ *   fp + 0 .. fp + nargs - 1      arguments, pushed by the caller in place
+ *   fp + nargs .. fp + nlocals - 1  other locals, zeroed on call
+ *   fp + nlocals .. sp - 1        operand stack
+ *
+ * the caller's fp and return pc are kept in a separate frame record
+ */
+struct frame {
+    int32_t ret_pc;
+    int32_t fp;
+};
+
+class vm;
+
+/**
+ * interactive debugging and profiling, see debugger.h and profiler.h. while
+ * a hook is set the vm runs a separate dispatch loop that calls before ahead
+ * of every instruction; the loop used otherwise has no checks at all. before returns false to
+ * stop the program, and may detach itself with vm::set_debugger(nullptr)
+ */
+class debug_hook {
+public:
+    virtual ~debug_hook() = default;
+    virtual bool before(vm& vm, program& prog) = 0;
+};
+
+/**
+ * lets calls leave the interpreter, see jit.h. call returns false to have
+ * the interpreter run the callee itself, otherwise the callee has run on the
+ * arguments at args and its return value is in result
+ */
+class call_hook {
+public:
+    virtual ~call_hook() = default;
+    virtual bool call(int32_t target, int32_t* args, int32_t& result) = 0;
 };
 
 class vm {
+public:
+    static constexpr size_t default_stack_slots = 1 << 20;
+    static constexpr size_t default_max_frames = 1 << 16;
+
 private:
     int32_t pc{0};
     int32_t fp{0};
+    int32_t sp{0};
+    // both are allocated once and never grow while running
     std::vector<int32_t> stack;
-    bool debug{false};
+    std::vector<frame> frames;
+    size_t max_frames;
+    debug_hook* debugger{nullptr};
+    call_hook* hook{nullptr};
+    output* out{&output::standard()};
+    // memoization mode: table of the function at each offset, if any
+    size_t memo_capacity{0};
+    std::vector<memo_table*> memo_at;
+    // calls whose result is to be cached once their frame at depth returns
+    struct memo_pending {
+        size_t depth;
+        memo_table* table;
+        int32_t args[memo_table::max_args];
+    };
+    std::vector<memo_pending> pending;
 
 public:
+    explicit vm(size_t stack_slots = default_stack_slots, size_t max_frames = default_max_frames)
+        : stack(stack_slots, 0), max_frames(max_frames) {
+        frames.reserve(max_frames);
+    }
+
     void eval(program& prog) {
-        while (pc < prog.insts.size()) {
-            if (debug) {
-                std::cout << "pc = " << pc << '\n';
-                std::cout << "stack: " << '\n';
-                show_stack();
-                std::cout << "program: " << '\n';
-                show_asm(prog);
-                std::cout << "> " << std::flush;
-                std::string line;
-                while (std::getline(std::cin, line)) {
-                    if (line == "quit") {
-                        return;
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before eval");
+        }
+        pc = prog.entry;
+        fp = 0;
+        sp = 0;
+        frames.clear();
+        pending.clear();
+        memo_at.clear();
+        // calls taken by the call hook could not be cached
+        if (memo_capacity > 0 && hook == nullptr) {
+            memo_at.assign(prog.insts.size() + 1, nullptr);
+            for (auto& sym : prog.syms) {
+                if (sym.second.pure && memo_table::fits(sym.second.nargs)) {
+                    sym.second.memo = std::make_shared<memo_table>(sym.second.nargs, memo_capacity);
+                    memo_at[sym.second.loc] = sym.second.memo.get();
+                }
+            }
+        }
+        VMLUA_TRACE(tc_vm, tl_info, "eval " << prog.insts.size() << " instructions from " << prog.entry);
+        enter_frame(0, prog.nlocals);
+        // whatever the script printed is out before the caller writes more
+        scope_guard flush([this]() { out->flush(); });
+        dispatch(prog);
+    }
+
+    // runs the function at target on nargs arguments already in place at
+    // args, returning its result. used to enter the interpreter from native code
+    int32_t call(program& prog, int32_t target, int32_t* args, size_t nargs, size_t nlocals) {
+        auto saved_pc = pc, saved_fp = fp, saved_sp = sp;
+        if (frames.size() == max_frames) {
+            throw std::runtime_error("stack overflow: too many nested calls");
+        }
+        // returning to pc -1 stops run
+        frames.push_back(frame{-1, fp});
+        sp = static_cast<int32_t>(args - stack.data() + nargs);
+        pc = target;
+        enter_frame(static_cast<int32_t>(args - stack.data()), nlocals);
+        dispatch(prog);
+        auto result = stack[sp - 1];
+        pc = saved_pc;
+        fp = saved_fp;
+        sp = saved_sp;
+        return result;
+    }
+
+    void set_call_hook(call_hook* hook) { this->hook = hook; }
+    // where print writes to, output::standard() by default
+    void set_output(output* out) { this->out = out; }
+    output& output_sink() { return *out; }
+    // caches the results of pure functions in tables of capacity entries, 0 disables it
+    void set_memo(size_t capacity) { memo_capacity = capacity; }
+    int32_t* stack_end() { return stack.data() + stack.size(); }
+
+private:
+    void dispatch(program& prog) {
+        if (debugger != nullptr) {
+            run<true>(prog);
+        } else {
+            run<false>(prog);
+        }
+    }
+    // instantiated twice, so that runs without a debugger pay nothing for it
+    template <bool debugging>
+    void run(program& prog) {
+        while (pc >= 0 && pc < prog.insts.size()) {
+            if constexpr (debugging) {
+                if (!debugger->before(*this, prog)) {
+                    return;
+                }
+                // detached, the rest runs without any checks
+                if (debugger == nullptr) {
+                    run<false>(prog);
+                    return;
+                }
+            }
+            auto& inst = prog.insts[pc];
+            switch (inst.op) {
+                case op_add: {
+                    auto right = pop_stack();
+                    auto left = pop_stack();
+                    push_stack(left + right);
+                    pc++;
+                    break;
+                }
+                case op_sub: {
+                    auto right = pop_stack();
+                    auto left = pop_stack();
+                    push_stack(left - right);
+                    pc++;
+                    break;
+                }
+                case op_cond: {
+                    auto right = pop_stack();
+                    auto left = pop_stack();
+                    push_stack(logic_cond(static_cast<logical_op>(inst.b), left, right));
+                    pc++;
+                    break;
+                }
+                case op_dup_plus_fp:
+                    push_stack(stack[fp + inst.a]);
+                    pc++;
+                    break;
+                case op_move_plus_fp:
+                    stack[fp + inst.a] = pop_stack();
+                    pc++;
+                    break;
+                case op_store:
+                    push_stack(inst.a);
+                    pc++;
+                    break;
+                case op_pop:
+                    sp--;
+                    pc++;
+                    break;
+                case op_ret:
+                    leave_frame(0);
+                    break;
+                case op_retval:
+                    leave_frame(stack[sp - 1]);
+                    break;
+                case op_jnz:
+                    if (pop_stack() != 0) {
+                        pc = inst.a;
+                        break;
                     }
-                    if (line == "debug off") {
-                        debug = false;
+                    pc += 1;
+                    break;
+                case op_jz:
+                    if (pop_stack() == 0) {
+                        pc = inst.a;
                         break;
                     }
-                    if (lb::string_util::start_with(line, "mem")) {
-                        auto args = lb::string_util::split(line, ' ', true, 3);
-                        if (args.size() == 2) {
-                            if (!lb::string_util::is_number(args[1])) {
-                                std::cout << "invalid argument: " << args[1] << std::endl;
-                                std::cout << "> " << std::flush;
-                                continue;
-                            }
-                            auto addr = std::stoi(args[1]);
-                            if (addr >= 0 && addr < stack.size()) {
-                                std::cout << "mem[" << addr << "] = " << stack.at(addr) << '\n';
-                            } else {
-                                std::cout << "mem[" << addr << "] = out of range\n";
-                            }
-                        } else if (args.size() == 3) {
-                            // you have no choice
-                            auto reg = args[1] == "pc" ? pc : pc;
-                            if (!lb::string_util::is_number(args[2])) {
-                                std::cout << "invalid argument: " << args[2] << std::endl;
-                                std::cout << "> " << std::flush;
-                                continue;
-                            }
-                            auto off = std::stoi(args[2]);
-                            auto addr = reg + off;
-                            if (addr >= 0 && addr < stack.size()) {
-                                std::cout << "mem[" << addr << "] = " << stack.at(addr) << '\n';
-                            } else {
-                                std::cout << "mem[" << addr << "] = out of range\n";
-                            }
-                        } else {
-                            std::cout << "invalid arguments\n";
-                        }
-                        std::cout << "> " << std::flush;
-                        continue;
+                    pc += 1;
+                    break;
+                case op_jmp:
+                    pc = inst.a;
+                    break;
+                case op_call: {
+                    int32_t result;
+                    if (!memo_at.empty() && memoized(inst, result)) {
+                        sp -= inst.b;
+                        stack[sp++] = result;
+                        pc++;
+                        break;
                     }
-                    if (line == "step" || line == "") {
+                    if (hook != nullptr && hook->call(inst.a, &stack[sp - inst.b], result)) {
+                        sp -= inst.b;
+                        stack[sp++] = result;
+                        pc++;
                         break;
                     }
-                    std::cout << "unknown command: " << line << '\n';
-                    std::cout << "> " << std::flush;
+                    if (frames.size() == max_frames) {
+                        throw std::runtime_error("stack overflow: too many nested calls");
+                    }
+                    frames.push_back(frame{pc + 1, fp});
+                    VMLUA_TRACE(tc_vm, tl_debug, "call " << symbol_at(prog, inst.a) << " depth " << frames.size());
+                    pc = inst.a;
+                    enter_frame(sp - inst.b, inst.c);
+                    break;
                 }
-            }
-            auto inst = prog.insts[pc].get();
-            if (auto* p = dynamic_cast<add_inst*>(inst)) {
-                auto right = pop_stack();
-                auto left = pop_stack();
-                push_stack(left + right);
-                pc++;
-            } else if (auto* p = dynamic_cast<subtract_inst*>(inst)) {
-                auto right = pop_stack();
-                auto left = pop_stack();
-                push_stack(left - right);
-                pc++;
-            } else if (auto* p = dynamic_cast<logic_cond_inst*>(inst)) {
-                auto right = pop_stack();
-                auto left = pop_stack();
-                int result = 0;
-                switch (p->op) {
-                    case AND:
-                        result = left & right;
-                        break;
-                    case OR:
-                        result = left | right;
-                        break;
-                    case LT:
-                        result = left < right;
+                case op_tailcall: {
+                    int32_t result;
+                    if (!memo_at.empty() && memoized(inst, result, frames.size())) {
+                        leave_frame(result);
                         break;
-                    case GT:
-                        result = left > right;
-                        break;
-                    case LE:
-                        result = left <= right;
-                        break;
-                    case GE:
-                        result = left >= right;
-                        break;
-                    case EQ:
-                        result = left == right;
-                        break;
-                    case NE:
-                        result = left != right;
+                    }
+                    if (hook != nullptr && hook->call(inst.a, &stack[sp - inst.b], result)) {
+                        leave_frame(result);
                         break;
-                }
-                push_stack(result);
-                pc++;
-            } else if (auto* p = dynamic_cast<dup_plus_fp_inst*>(inst)) {
-                push_stack(stack.at(fp + p->offset));
-                pc++;
-            } else if (auto* p = dynamic_cast<move_minus_fp_inst*>(inst)) {
-                stack.at(fp + p->local_off) = stack.at((fp - (p->fp_off + 4)));
-                pc++;
-            } else if (auto* p = dynamic_cast<move_plus_fp_inst*>(inst)) {
-                auto val = pop_stack();
-                auto index = static_cast<size_t>(fp) + p->value;
-                while (index >= stack.size()) {
-                    stack.push_back(0);
-                }
-                stack.at(index) = val;
-                pc++;
-            } else if (auto* p = dynamic_cast<store_inst*>(inst)) {
-                push_stack(p->n);
-                pc++;
-            } else if (auto* p = dynamic_cast<return_inst*>(inst)) {
-                if (!p->has_value) {
-                    auto nargs = pop_stack();
-                    pc = pop_stack();
-                    fp = pop_stack();
-                    continue;
-                }
-                auto ret = pop_stack();
-                while (fp < stack.size()) {
-                    pop_stack();
-                }
-                auto nargs = pop_stack();
-                pc = pop_stack();
-                fp = pop_stack();
-                while (nargs--) {
-                    pop_stack();
-                }
-                push_stack(ret);
-            } else if (auto* p = dynamic_cast<jump_if_not_zero_inst*>(inst)) {
-                auto value = pop_stack();
-                if (value != 0) {
-                    pc = prog.syms[p->label].loc;
-                    continue;
-                }
-                pc += 1;
-            } else if (auto* p = dynamic_cast<jump_if_zero_inst*>(inst)) {
-                auto value = pop_stack();
-                if (value == 0) {
-                    pc = prog.syms[p->label].loc;
-                    continue;
-                }
-                pc += 1;
-            } else if (auto* p = dynamic_cast<jump_inst*>(inst)) {
-                pc = prog.syms[p->label].loc;
-            } else if (auto* p = dynamic_cast<call_inst*>(inst)) {
-                if (p->label == "print") {
-                    for (int i = 0; i < p->argc; i++) {
-                        std::cout << pop_stack() << " ";
                     }
-                    std::cout << std::endl;
+                    // the arguments replace the current frame, the frame
+                    // record and so the return address stay as they are
+                    VMLUA_TRACE(tc_vm, tl_debug, "tailcall " << symbol_at(prog, inst.a) << " depth " << frames.size());
+                    std::copy(stack.begin() + sp - inst.b, stack.begin() + sp, stack.begin() + fp);
+                    sp = fp + inst.b;
+                    pc = inst.a;
+                    enter_frame(fp, inst.c);
+                    break;
+                }
+                case op_print:
+                    print(inst.c);
+                    push_stack(0);
+                    pc++;
+                    break;
+                case op_native: {
+                    auto result = (*prog.natives)[inst.a].fn(&stack[sp - inst.c], inst.c);
+                    sp -= inst.c;
+                    stack[sp++] = result;
                     pc++;
-                    continue;
+                    break;
                 }
-                push_stack(fp);
-                push_stack(pc + 1);
-                push_stack(prog.syms[p->label].nargs);
-                pc = prog.syms[p->label].loc;
-                fp = stack.size();
-
-                auto nlocals = prog.syms[p->label].nlocals;
-                while (nlocals--) {
-                    stack.push_back(0);
+                case op_push_fp2:
+                    push_stack(stack[fp + inst.c]);
+                    push_stack(stack[fp + inst.a]);
+                    pc++;
+                    break;
+                case op_push_fp_k:
+                    push_stack(stack[fp + inst.c]);
+                    push_stack(inst.a);
+                    pc++;
+                    break;
+                case op_add_fp_k:
+                    push_stack(stack[fp + inst.c] + inst.a);
+                    pc++;
+                    break;
+                case op_sub_fp_k:
+                    push_stack(stack[fp + inst.c] - inst.a);
+                    pc++;
+                    break;
+                case op_add_fp_fp:
+                    push_stack(stack[fp + inst.c] + stack[fp + inst.a]);
+                    pc++;
+                    break;
+                case op_cond_fp_fp:
+                    push_stack(logic_cond(static_cast<logical_op>(inst.b), stack[fp + inst.c], stack[fp + inst.a]));
+                    pc++;
+                    break;
+                case op_cond_fp_k:
+                    push_stack(logic_cond(static_cast<logical_op>(inst.b), stack[fp + inst.c], inst.a));
+                    pc++;
+                    break;
+                case op_jncond: {
+                    auto right = pop_stack();
+                    auto left = pop_stack();
+                    pc = logic_cond(static_cast<logical_op>(inst.b), left, right) ? pc + 1 : inst.a;
+                    break;
                 }
-            } else {
-                throw std::runtime_error("unknown instruction");
+                case op_ret_fp:
+                    leave_frame(stack[fp + inst.a]);
+                    break;
+                case op_ret_k:
+                    leave_frame(inst.a);
+                    break;
+                case op_ret_add_fp_fp:
+                    leave_frame(stack[fp + inst.c] + stack[fp + inst.a]);
+                    break;
+                case op_print_pop:
+                    print(inst.c);
+                    pc++;
+                    break;
+                default:
+                    throw std::runtime_error("unknown instruction");
             }
         }
     }
-    void set_debug(bool debug) { this->debug = debug; }
-    void show_asm(program& prog) {
-        auto vpc = 0;
-        std::cout << std::setw(8) << "--------"
+
+public:
+    void set_debugger(debug_hook* debugger) { this->debugger = debugger; }
+    int32_t program_counter() const { return pc; }
+    int32_t frame_pointer() const { return fp; }
+    int32_t stack_pointer() const { return sp; }
+    int32_t stack_at(int32_t addr) const { return stack[addr]; }
+    // records of the active calls, outermost first
+    std::vector<frame> const& call_frames() const { return frames; }
+
+    // disassembles the instructions from first up to last, all by default.
+    // counts, if given, are shown in a column in front, indexed by offset
+    void show_asm(program& prog, int32_t first = 0, int32_t last = INT32_MAX,
+                  std::vector<uint64_t> const* counts = nullptr) {
+        show_asm(std::cout, prog, first, last, counts);
+    }
+    void show_asm(std::ostream& os, program& prog, int32_t first = 0, int32_t last = INT32_MAX,
+                  std::vector<uint64_t> const* counts = nullptr) {
+        if (!prog.linked) {
+            throw std::runtime_error("program must be linked before show_asm");
+        }
+        auto vpc = std::max(first, 0);
+        last = std::min(last, static_cast<int32_t>(prog.insts.size()));
+        auto column = [&](std::string const& text) {
+            if (counts != nullptr) {
+                os << std::setw(12) << text << " |";
+            }
+        };
+        column("------------");
+        os << std::setw(8) << "--------"
                   << "+------------------------------" << std::endl;
-        std::cout << std::setw(8) << " OFFSET "
+        column("COUNT ");
+        os << std::setw(8) << " OFFSET "
                   << "| INSTRUCTION" << std::endl;
-        std::cout << std::setw(8) << "--------"
+        column("------------");
+        os << std::setw(8) << "--------"
                   << "+------------------------------" << std::endl;
 
-        while (vpc < prog.insts.size()) {
-            if (debug) {
-                std::cout << " "                      //
+        while (vpc < last) {
+            column(counts != nullptr ? std::to_string((*counts)[vpc]) : "");
+            if (debugger != nullptr) {
+                os << " "                      //
                           << (vpc == pc ? "*" : " ")  //
                           << std::setw(5) << vpc << "| ";
             } else {
-                std::cout << std::setw(8) << vpc << "| ";
+                os << std::setw(8) << vpc << "| ";
             }
             // print labels
             for (auto& sym : prog.syms) {
                 if (vpc == sym.second.loc) {
-                    std::cout << sym.first << ": " << std::endl
-                              << std::setw(8) << " "
+                    os << sym.first << ": " << std::endl;
+                    column("");
+                    os << std::setw(8) << " "
                               << "| ";
                 }
             }
-            std::cout << std::setw(4) << " ";
-            auto inst = prog.insts[vpc].get();
-            if (auto* p = dynamic_cast<add_inst*>(inst)) {
-                std::cout << "ADD" << std::endl;
-            } else if (auto* p = dynamic_cast<subtract_inst*>(inst)) {
-                std::cout << "SUB" << std::endl;
-            } else if (auto* p = dynamic_cast<logic_cond_inst*>(inst)) {
-                std::string cond;
-                switch (p->op) {
-                    case AND:
-                        cond = "AND";
-                        break;
-                    case OR:
-                        cond = "OR";
-                        break;
-                    case LT:
-                        cond = "LT";
-                        break;
-                    case GT:
-                        cond = "GT";
-                        break;
-                    case LE:
-                        cond = "LE";
-                        break;
-                    case GE:
-                        cond = "GE";
-                        break;
-                    case EQ:
-                        cond = "EQ";
-                        break;
-                    case NE:
-                        cond = "NE";
-                        break;
-                }
-                std::cout << "COND " << cond << std::endl;
-            } else if (auto* p = dynamic_cast<dup_plus_fp_inst*>(inst)) {
-                std::cout << "PUSH FP + " << p->offset << std::endl;
-            } else if (auto* p = dynamic_cast<move_minus_fp_inst*>(inst)) {
-                std::cout << "ST FP - " << (p->fp_off + 4) << " -> "
-                          << "FP + " << p->local_off << std::endl;
-            } else if (auto* p = dynamic_cast<move_plus_fp_inst*>(inst)) {
-                auto index = static_cast<size_t>(fp) + p->value;
-                std::cout << "POP FP + " << p->value << "" << std::endl;
-            } else if (auto* p = dynamic_cast<store_inst*>(inst)) {
-                std::cout << "PUSH " << p->n << std::endl;
-            } else if (auto* p = dynamic_cast<return_inst*>(inst)) {
-                if (p->has_value) {
-                    std::cout << "RETVAL" << std::endl;
-                } else {
-                    std::cout << "RET" << std::endl;
-                }
-                std::cout << std::setw(8) << vpc << "| " << std::endl;
-            } else if (auto* p = dynamic_cast<jump_if_not_zero_inst*>(inst)) {
-                std::cout << "JNZ " << p->label << " (offset=" << prog.syms[p->label].loc << ")" << std::endl;
-            } else if (auto* p = dynamic_cast<jump_if_zero_inst*>(inst)) {
-                std::cout << "JZ " << p->label << " (offset=" << prog.syms[p->label].loc << ")" << std::endl;
-            } else if (auto* p = dynamic_cast<jump_inst*>(inst)) {
-                std::cout << "JMP " << p->label << " (offset=" << prog.syms[p->label].loc << ")" << std::endl;
-            } else if (auto* p = dynamic_cast<call_inst*>(inst)) {
-                if (p->label == "print") {
-                    std::cout << "CALL print@internal, ARGC=" << p->argc << std::endl;
-                } else {
-                    std::cout << "CALL " << p->label << "(" << prog.syms[p->label].loc
-                              << "), nargs=" << prog.syms[p->label].nargs << ", nlocals=" << prog.syms[p->label].nlocals
+            os << std::setw(4) << " ";
+            auto& inst = prog.insts[vpc];
+            switch (inst.op) {
+                case op_add:
+                    os << "ADD" << std::endl;
+                    break;
+                case op_sub:
+                    os << "SUB" << std::endl;
+                    break;
+                case op_cond:
+                    os << "COND " << to_string(static_cast<logical_op>(inst.b)) << std::endl;
+                    break;
+                case op_dup_plus_fp:
+                    os << "PUSH FP + " << inst.a << std::endl;
+                    break;
+                case op_move_plus_fp:
+                    os << "POP FP + " << inst.a << "" << std::endl;
+                    break;
+                case op_store:
+                    os << "PUSH " << inst.a << std::endl;
+                    break;
+                case op_pop:
+                    os << "POP" << std::endl;
+                    break;
+                case op_ret:
+                case op_retval:
+                    os << (inst.op == op_retval ? "RETVAL" : "RET") << std::endl;
+                    column("");
+                    os << std::setw(8) << vpc << "| " << std::endl;
+                    break;
+                case op_jnz:
+                case op_jz:
+                case op_jmp: {
+                    static const char* names[] = {"JNZ ", "JZ ", "JMP "};
+                    os << names[inst.op - op_jnz] << symbol_at(prog, inst.a) << " (offset=" << inst.a << ")"
                               << std::endl;
+                    break;
                 }
-            } else {
-                throw std::runtime_error("unknown instruction");
+                case op_call:
+                    os << "CALL " << symbol_at(prog, inst.a) << "(" << inst.a << "), nargs=" << int(inst.b)
+                              << ", nlocals=" << inst.c << std::endl;
+                    break;
+                case op_tailcall:
+                    os << "TAILCALL " << symbol_at(prog, inst.a) << "(" << inst.a << "), nargs=" << int(inst.b)
+                              << ", nlocals=" << inst.c << std::endl;
+                    column("");
+                    os << std::setw(8) << vpc << "| " << std::endl;
+                    break;
+                case op_print:
+                    os << "CALL print@internal, ARGC=" << inst.c << std::endl;
+                    break;
+                case op_native:
+                    os << "CALL " << (*prog.natives)[inst.a].name << "@native(" << inst.a
+                              << "), ARGC=" << inst.c << std::endl;
+                    break;
+                case op_push_fp2:
+                    os << "PUSH FP + " << inst.c << ", FP + " << inst.a << std::endl;
+                    break;
+                case op_push_fp_k:
+                    os << "PUSH FP + " << inst.c << ", " << inst.a << std::endl;
+                    break;
+                case op_add_fp_k:
+                    os << "ADD FP + " << inst.c << ", " << inst.a << std::endl;
+                    break;
+                case op_sub_fp_k:
+                    os << "SUB FP + " << inst.c << ", " << inst.a << std::endl;
+                    break;
+                case op_add_fp_fp:
+                    os << "ADD FP + " << inst.c << ", FP + " << inst.a << std::endl;
+                    break;
+                case op_cond_fp_fp:
+                    os << "COND " << to_string(static_cast<logical_op>(inst.b)) << " FP + " << inst.c
+                              << ", FP + " << inst.a << std::endl;
+                    break;
+                case op_cond_fp_k:
+                    os << "COND " << to_string(static_cast<logical_op>(inst.b)) << " FP + " << inst.c << ", "
+                              << inst.a << std::endl;
+                    break;
+                case op_jncond:
+                    os << "JN" << to_string(static_cast<logical_op>(inst.b)) << " " << symbol_at(prog, inst.a)
+                              << " (offset=" << inst.a << ")" << std::endl;
+                    break;
+                case op_ret_fp:
+                case op_ret_k:
+                case op_ret_add_fp_fp:
+                    if (inst.op == op_ret_fp) {
+                        os << "RETVAL FP + " << inst.a << std::endl;
+                    } else if (inst.op == op_ret_k) {
+                        os << "RETVAL " << inst.a << std::endl;
+                    } else {
+                        os << "RETVAL FP + " << inst.c << " + FP + " << inst.a << std::endl;
+                    }
+                    column("");
+                    os << std::setw(8) << vpc << "| " << std::endl;
+                    break;
+                case op_print_pop:
+                    os << "CALL print@internal, ARGC=" << inst.c << "; POP" << std::endl;
+                    break;
+                default:
+                    throw std::runtime_error("unknown instruction");
             }
             vpc++;
         }
     }
     void show_stack() {
-        auto size = stack.size();
+        auto size = sp;
         if (size == 0) {
             std::cout << "(empty)" << '\n';
             return;
@@ -383,12 +672,74 @@ public:
     }
 
 private:
-    int32_t pop_stack() {
-        auto v = stack.back();
-        stack.pop_back();
-        return v;
+    // syms are kept for disassembly only
+    static std::string symbol_at(program const& prog, int32_t loc) {
+        for (auto& sym : prog.syms) {
+            if (sym.second.loc == loc) {
+                return sym.first;
+            }
+        }
+        return "?";
+    }
+    void print(size_t argc) {
+        for (size_t i = 0; i < argc; i++) {
+            out->write(pop_stack());
+            out->put(' ');
+        }
+        out->end_line();
+    }
+    int32_t pop_stack() { return stack[--sp]; }
+    void push_stack(int32_t v) {
+        if (sp == stack.size()) {
+            throw std::runtime_error("stack overflow: value stack exhausted");
+        }
+        stack[sp++] = v;
+    }
+    // the first nargs locals are already in place
+    void enter_frame(int32_t new_fp, size_t nlocals) {
+        // the linker rejects calls with fewer arguments than the callee takes
+        assert(new_fp >= fp);
+        if (new_fp + nlocals > stack.size()) {
+            throw std::runtime_error("stack overflow: value stack exhausted");
+        }
+        std::fill(stack.begin() + sp, stack.begin() + new_fp + nlocals, 0);
+        fp = new_fp;
+        sp = new_fp + nlocals;
+    }
+    // looks the call up in the callee's table. on a miss the result is
+    // cached when the frame at depth returns, by default the callee's own
+    bool memoized(instruction const& inst, int32_t& result, size_t depth = SIZE_MAX) {
+        auto* table = memo_at[inst.a];
+        if (table == nullptr) {
+            return false;
+        }
+        auto* args = &stack[sp - inst.b];
+        if (table->lookup(args, result)) {
+            return true;
+        }
+        memo_pending call{depth == SIZE_MAX ? frames.size() + 1 : depth, table};
+        std::copy(args, args + inst.b, call.args);
+        pending.push_back(call);
+        return false;
+    }
+    void leave_frame(int32_t ret) {
+        // a tail call leaves the pending entry of its caller at the same depth
+        while (!pending.empty() && pending.back().depth == frames.size()) {
+            pending.back().table->insert(pending.back().args, ret);
+            pending.pop_back();
+        }
+        // a return at top level ends the script, as in cpp_emitter
+        if (frames.empty()) {
+            pc = -1;
+            return;
+        }
+        auto& f = frames.back();
+        pc = f.ret_pc;
+        sp = fp;
+        fp = f.fp;
+        frames.pop_back();
+        stack[sp++] = ret;
     }
-    void push_stack(int32_t v) { stack.push_back(v); }
 };
 
 }  // namespace lb::vmlua
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <string_view>
@@ -50,6 +51,16 @@ public:
     std::string input_file() const noexcept { return _input_file; }
 };
 
+// host functions available to every script. there is no * operator, so
+// mul stands in for it. both wrap around like + and -
+void register_natives(lb::vmlua::native_registry &natives)
+{
+    natives.add("abs", 1, [](int32_t const *args, size_t)
+                { return args[0] < 0 ? static_cast<int32_t>(0u - static_cast<uint32_t>(args[0])) : args[0]; });
+    natives.add("mul", 2, [](int32_t const *args, size_t)
+                { return static_cast<int32_t>(static_cast<uint32_t>(args[0]) * static_cast<uint32_t>(args[1])); });
+}
+
 int main(int argc, char const *argv[])
 {
     cli_options options;
@@ -66,6 +77,7 @@ int main(int argc, char const *argv[])
         return 1;
     }
     lb::vmlua::driver driver(options.input_file());
+    register_natives(driver.natives());
     driver.run();
     return 0;
 }
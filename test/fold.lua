@@ -0,0 +1,27 @@
+function unread()
+   local a = 5;
+   local b = 6;
+   return c;
+end
+
+function dead(x)
+   if 0 then
+      local q = 1;
+   end
+   local r = 7;
+   return q + r;
+end
+
+function first()
+   if 1 then
+      local s = 2;
+   else
+      local t = 3;
+   end
+   local u = 4;
+   return t + u;
+end
+
+local a = 5;
+print(b);
+print(unread(), dead(1), first());
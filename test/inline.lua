@@ -0,0 +1,38 @@
+function add(a, b)
+   return a + b;
+end
+
+function pick(c, a, b)
+   if c then
+      return a;
+   end
+   return b;
+end
+
+function twice(x)
+   local y = add(x, x);
+   return add(y, y);
+end
+
+function noisy(x)
+   print(x);
+end
+
+function big(a)
+   local b = add(a, 1);
+   local c = add(b, 2);
+   local d = add(c, 3);
+   local e = add(d, 4);
+   if e > 20 then
+      return pick(e, e, 0);
+   else
+      return pick(0, e, add(e, 100));
+   end
+end
+
+print(add(2, 3), pick(1, 7, 8), pick(0, 7, 8));
+print(twice(5));
+print(noisy(9));
+print(big(1), big(11));
+local a = 4;
+print(add(a, twice(a)));
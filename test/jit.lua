@@ -0,0 +1,43 @@
+function sum(n)
+   if n == 0 then
+      return 0;
+   end
+   return n + sum(n + -1);
+end
+
+function loop(n, acc)
+   if n < 1 then
+      return acc;
+   end
+   return loop(n + -1, acc + n + n);
+end
+
+function sign(x)
+   if x > 0 then
+      return 1;
+   end
+   if x < 0 then
+      return -1;
+   end
+   return 0;
+end
+
+function mix(a, b)
+   local c = a + b + a;
+   local d = c + sign(a + -5);
+   if a >= b and b != 0 then
+      return d;
+   end
+   return d + 100;
+end
+
+function show(x)
+   print(x, sign(x));
+   return x;
+end
+
+print(sum(3000));
+print(loop(30000, 0));
+print(sign(7), sign(-7), sign(0));
+print(mix(6, 4), mix(2, 9), mix(3, 0));
+print(show(5) + show(-3));
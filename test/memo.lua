@@ -0,0 +1,21 @@
+function fib(n)
+   if n < 2 then
+      return n;
+   end
+   return fib(n + -1) + fib(n + -2);
+end
+
+function loud(x)
+   print(x);
+   return x + 1;
+end
+
+function quiet(x)
+   return loud(x) + 1;
+end
+
+print(fib(30));
+print(fib(30), fib(29));
+print(loud(4));
+print(loud(4));
+print(quiet(6), quiet(6));
@@ -0,0 +1,5 @@
+function mul(a, b)
+   return a + b;
+end
+
+print(mul(2, 3));
@@ -0,0 +1,14 @@
+function square(x)
+   return mul(x, x);
+end
+
+function dist(a)
+   return abs(a + -5) + 1;
+end
+
+print(abs(-7), abs(7), abs(0));
+print(mul(6, 7), mul(-3, 5));
+print(square(12));
+print(dist(3), dist(12));
+local n = mul(abs(-4), 5);
+print(n + 1);
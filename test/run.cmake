@@ -0,0 +1,32 @@
+# runs SCRIPT with VMLUA and compares what it prints, less the [driver]
+# lines, with the file EXPECTED. with AOT set, the script is built into the
+# executable AOT and that is run instead. an EXPECTED .err file holds an
+# error the script must fail with instead
+get_filename_component(kind ${EXPECTED} EXT)
+file(READ ${EXPECTED} expected)
+if (DEFINED AOT)
+    set(ENV{VM_LUA_AOT} ${AOT})
+    execute_process(COMMAND ${VMLUA} ${SCRIPT} OUTPUT_QUIET ERROR_VARIABLE error RESULT_VARIABLE status)
+    if (status EQUAL 0)
+        execute_process(COMMAND ${AOT} OUTPUT_VARIABLE output ERROR_VARIABLE error RESULT_VARIABLE status)
+    elseif (NOT kind STREQUAL ".err")
+        message(FATAL_ERROR "building ${SCRIPT} exited with ${status}\n${error}")
+    endif()
+else()
+    execute_process(COMMAND ${VMLUA} ${SCRIPT} OUTPUT_VARIABLE output ERROR_VARIABLE error RESULT_VARIABLE status)
+endif()
+if (kind STREQUAL ".err")
+    string(STRIP "${expected}" expected)
+    string(FIND "${error}" "${expected}" at)
+    if (status EQUAL 0 OR at EQUAL -1)
+        message(FATAL_ERROR "${SCRIPT} exited with ${status}\n${error}\nbut expected to fail with\n${expected}")
+    endif()
+    return()
+endif()
+if (NOT status EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} exited with ${status}\n${error}")
+endif()
+string(REGEX REPLACE "[^\n]*\\[driver\\][^\n]*\n" "" output "${output}")
+if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "${SCRIPT} printed\n${output}\nbut expected\n${expected}")
+endif()
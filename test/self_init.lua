@@ -0,0 +1,15 @@
+function f(a)
+   local x = x + 1;
+   return x;
+end
+
+function g(a)
+   local y = a + 2;
+   local y = y + 10;
+   return y;
+end
+
+print(f(5));
+print(g(1));
+local z = z + 3;
+print(z);
@@ -0,0 +1,24 @@
+local x = 1;
+local x = 2;
+print(x);
+
+function f(a)
+   local a = 5;
+   local y = 3;
+   if a then
+      local y = 7;
+      print(y);
+   end
+   return a + y;
+end
+print(f(4));
+
+function g(n)
+   if n then
+      local z = 4;
+   end
+   local z = 9;
+   return z;
+end
+print(g(1));
+print(g(0));
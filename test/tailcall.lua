@@ -0,0 +1,23 @@
+function count(n, acc)
+   if n == 0 then
+      return acc;
+   end
+   return count(n + -1, acc + 1);
+end
+
+function ping(n)
+   if n == 0 then
+      return 1;
+   end
+   return pong(n + -1);
+end
+
+function pong(n)
+   if n == 0 then
+      return 2;
+   end
+   return ping(n + -1);
+end
+
+print(count(200000, 0));
+print(ping(100001));
@@ -0,0 +1,14 @@
+function f(x)
+   return x + 1;
+end
+function g()
+   print(f(2), zz);
+   local a = 1;
+   return 0;
+end
+function h()
+   print(f(5), zz);
+   return 0;
+end
+print(g(), h());
+print(1, zz);